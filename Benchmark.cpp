@@ -0,0 +1,590 @@
+﻿// Микробенчмарки движка таймеров.
+//
+// Без аргументов прогоняет весь набор: для каждого движка, случая и размера
+// запускает сам себя отдельным процессом (чистое состояние движка и честный замер памяти).
+// С ключами --engine=... --case=... --n=... [--hires] [--slack=<мс>] [--power-save]
+// [--shards=N] выполняет один случай
+// и печатает строку результата в stderr; вывод самого движка идёт в stdout, набор
+// отправляет его в NUL. Движок sharded — колесо с шардом на каждое ядро (--shards=0),
+// heap — куча сроков вместо колеса (EngineKind::Heap).
+//
+// Случаи:
+//   add     — пропускная способность add_timer (возврат вызова и полный приём движком);
+//             добавляют по потоку на шард, так что у sharded она растёт с числом ядер;
+//   cancel  — задержка cancel_timer, p50/p99/max;
+//   expiry  — опоздание срабатывания (момент обработки минус TimerInfo::end) и пробуждения
+//             диспетчеров; ещё раз — в высокоточном режиме (--hires) и с допуском
+//             kSuiteSlack (--slack), когда близкие сроки срабатывают одной пачкой;
+//   callback — то же опоздание, когда у каждого таймера медленный колбэк (kSlowCallback):
+//             колбэки идут в пуле исполнителей и не должны задерживать срабатывания;
+//   list    — время list_timers;
+//   scan    — время list running --limit 10: отбор и подсчёт не показанных идут по
+//             горячему столбцу таблицы, без обращения к записям;
+//   memory  — прирост памяти процесса на один ожидающий таймер;
+//   flows   — то же на один сценарий-корутину (TimerFlow), ждущий в co_await;
+//   idle    — пробуждения диспетчеров в секунду, пока ждут таймеры на минуты и часы,
+//             и (Linux) добровольные переключения контекста всего процесса — пробуждения,
+//             которые ОС делает внутри ожиданий; ещё раз — в экономном режиме (--power-save);
+//   service — добавление и срабатывание в TimerService с очередью движка (только wheel
+//             и heap) на ручных часах: без блокировок и с мьютексом, без потоков движка;
+//             таймеры, сработавшие не по сроку, отмечаются в строке результата;
+//   replay  — сутки добавлений и отмен, проигранные в виртуальном времени (replay_trace,
+//             только wheel и heap): за сколько и почём одна операция.
+//
+// --replay=<файл> [--engine=wheel|heap] проигрывает записанную приложением трассу (--trace).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "TimerCoroutine.h"
+#include "TimerEngine.h"
+#include "TimerReplay.h"
+#include "TimerService.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <fstream>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// Потоков больше этого поток-на-таймер не тянет, такие случаи пропускаются.
+constexpr std::size_t kThreadsEngineLimit = 10000;
+
+// Колбэков на случай callback больше этого пул в разумное время не выполнит.
+constexpr std::size_t kCallbackLimit = 10000;
+
+// Сколько занимает колбэк в случае callback.
+constexpr std::chrono::microseconds kSlowCallback{ 200 };
+
+// Допуск --slack для expiry в наборе.
+constexpr std::chrono::milliseconds kSuiteSlack{ 20 };
+
+// Сколько наблюдать простаивающий движок в случае idle.
+constexpr std::chrono::seconds kIdleWindow{ 2 };
+
+// Длительность «долгих» таймеров, которые не должны сработать во время замера.
+constexpr std::chrono::seconds kLongTimer{ 3600 };
+
+// Память процесса в байтах: private bytes на Windows, RSS на Linux.
+std::size_t process_memory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS_EX pmc{};
+    GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&pmc), sizeof(pmc));
+    return pmc.PrivateUsage;
+#else
+    std::ifstream statm("/proc/self/statm");
+    std::size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+double to_ms(Clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+double to_us(Clock::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+// Перцентиль p (0..1) отсортированной выборки.
+Clock::duration percentile(const std::vector<Clock::duration>& sorted, double p) {
+    if (sorted.empty()) {
+        return Clock::duration::zero();
+    }
+    auto index = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1));
+    return sorted[index];
+}
+
+// Ждёт, пока движок примет все заявки (или пока не выйдет timeout).
+bool wait_for_timer_count(std::size_t n, std::chrono::seconds timeout) {
+    auto deadline = Clock::now() + timeout;
+    while (timer_count() < n) {
+        if (Clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Опоздания срабатываний, собираемые FireHook (он вызывается под мьютексом шарда,
+// при нескольких шардах — из нескольких диспетчеров сразу).
+std::vector<Clock::duration> g_lateness;
+std::atomic<std::size_t> g_claimed{ 0 }; // Выданные ячейки g_lateness.
+std::atomic<std::size_t> g_fired{ 0 };   // Записанные: release после записи ячейки.
+
+void record_fire(TimerId, Clock::time_point end, Clock::time_point fired) {
+    std::size_t i = g_claimed.fetch_add(1, std::memory_order_relaxed);
+    if (i < g_lateness.size()) {
+        g_lateness[i] = fired - end;
+    }
+    g_fired.fetch_add(1, std::memory_order_release);
+}
+
+void report(std::string_view engine, std::string_view name, std::size_t n, const std::string& result) {
+    std::cerr << std::left << std::setw(11) << engine << std::setw(9) << name
+        << std::right << std::setw(9) << n << "  " << result << "\n";
+}
+
+void add_long_timers(std::size_t n, std::vector<TimerId>* ids) {
+    for (std::size_t i = 0; i < n; ++i) {
+        TimerId id = add_timer(kLongTimer, "bench");
+        if (ids) ids->push_back(id);
+    }
+}
+
+std::string run_add(std::size_t n) {
+    // По потоку на шард: каждый поток пишет в свой шард (см. g_shard_count).
+    const std::size_t producers = g_shard_count;
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (std::size_t p = 1; p < producers; ++p) {
+        threads.emplace_back(add_long_timers, n / producers, nullptr);
+    }
+    add_long_timers(n - n / producers * (producers - 1), nullptr);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto returned = Clock::now();
+    bool accepted = wait_for_timer_count(n, std::chrono::seconds(120));
+    auto done = Clock::now();
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(0)
+        << "вызовы: " << static_cast<double>(n) / std::chrono::duration<double>(returned - start).count() << " оп/с"
+        << ", приём: " << static_cast<double>(n) / std::chrono::duration<double>(done - start).count() << " оп/с"
+        << std::setprecision(1) << " (" << to_ms(done - start) << " мс)";
+    if (producers > 1) oss << ", потоков " << producers;
+    if (!accepted) oss << " [НЕ ВСЕ ПРИНЯТЫ]";
+    return oss.str();
+}
+
+std::string run_cancel(std::size_t n) {
+    std::vector<TimerId> ids;
+    ids.reserve(n);
+    add_long_timers(n, &ids);
+    wait_for_timer_count(n, std::chrono::seconds(120));
+
+    std::vector<Clock::duration> latency;
+    latency.reserve(n);
+    for (TimerId id : ids) {
+        auto start = Clock::now();
+        cancel_timer(id);
+        latency.push_back(Clock::now() - start);
+    }
+    std::sort(latency.begin(), latency.end());
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(2)
+        << "p50 " << to_us(percentile(latency, 0.50)) << " мкс"
+        << ", p99 " << to_us(percentile(latency, 0.99)) << " мкс"
+        << ", max " << to_us(latency.empty() ? Clock::duration::zero() : latency.back()) << " мкс";
+    return oss.str();
+}
+
+std::string run_expiry(std::size_t n, const TimerCallback& on_fire = {}) {
+    g_lateness.assign(n, Clock::duration::zero());
+    g_fire_hook = record_fire;
+    start_engine();
+
+    // Сроки раскиданы по двум соседним секундам.
+    for (std::size_t i = 0; i < n; ++i) {
+        add_timer(std::chrono::seconds(1 + static_cast<long long>(i % 2)), "bench", on_fire);
+    }
+    auto deadline = Clock::now() + std::chrono::seconds(60);
+    while (g_fired.load(std::memory_order_acquire) < n && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    std::size_t fired = std::min(g_fired.load(), n);
+    std::vector<Clock::duration> lateness(g_lateness.begin(), g_lateness.begin() + static_cast<std::ptrdiff_t>(fired));
+    std::sort(lateness.begin(), lateness.end());
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(2)
+        << "опоздание p50 " << to_ms(percentile(lateness, 0.50)) << " мс"
+        << ", p99 " << to_ms(percentile(lateness, 0.99)) << " мс"
+        << ", max " << to_ms(lateness.empty() ? Clock::duration::zero() : lateness.back()) << " мс";
+    if (g_engine != EngineKind::Threads) oss << ", пробуждений " << dispatcher_wakeups();
+    if (fired < n) oss << " [сработало " << fired << " из " << n << "]";
+    return oss.str();
+}
+
+std::string run_list(std::size_t n) {
+    add_long_timers(n, nullptr);
+    wait_for_timer_count(n, std::chrono::seconds(120));
+
+    constexpr int kRepeats = 3;
+    Clock::duration best = Clock::duration::max();
+    for (int i = 0; i < kRepeats; ++i) {
+        auto start = Clock::now();
+        list_timers();
+        best = std::min(best, Clock::now() - start);
+    }
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3) << "лучшее из " << kRepeats << ": " << to_ms(best) << " мс";
+    return oss.str();
+}
+
+std::string run_scan(std::size_t n) {
+    add_long_timers(n, nullptr);
+    wait_for_timer_count(n, std::chrono::seconds(120));
+
+    ListFilter filter;
+    filter.running_only = true;
+    filter.limit = 10;
+    constexpr int kRepeats = 3;
+    Clock::duration best = Clock::duration::max();
+    for (int i = 0; i < kRepeats; ++i) {
+        auto start = Clock::now();
+        list_timers(filter);
+        best = std::min(best, Clock::now() - start);
+    }
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3) << "лучшее из " << kRepeats << ": " << to_ms(best) << " мс";
+    return oss.str();
+}
+
+std::string run_memory(std::size_t n) {
+    // Даём движку и писателю выйти на рабочий режим до первого замера.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::size_t before = process_memory();
+    add_long_timers(n, nullptr);
+    wait_for_timer_count(n, std::chrono::seconds(120));
+    std::size_t after = process_memory();
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1)
+        << (after > before ? static_cast<double>(after - before) / static_cast<double>(n) : 0.0)
+        << " байт/таймер (всего +" << (after > before ? (after - before) / 1024 : 0) << " КБ)";
+    return oss.str();
+}
+
+TimerFlow wait_long() {
+    co_await sleep_for(kLongTimer, "bench");
+}
+
+std::string run_flows(std::size_t n) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::size_t before = process_memory();
+    for (std::size_t i = 0; i < n; ++i) {
+        wait_long();
+    }
+    wait_for_timer_count(n, std::chrono::seconds(120));
+    std::size_t after = process_memory();
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1)
+        << (after > before ? static_cast<double>(after - before) / static_cast<double>(n) : 0.0)
+        << " байт/сценарий (всего +" << (after > before ? (after - before) / 1024 : 0) << " КБ)";
+    return oss.str();
+}
+
+std::string run_idle(std::size_t n) {
+    // Сроки от минуты до двух часов, вразнобой.
+    for (std::size_t i = 0; i < n; ++i) {
+        add_timer(std::chrono::seconds(60 + static_cast<long long>(i * 7919 % 7140)), "bench");
+    }
+    wait_for_timer_count(n, std::chrono::seconds(120));
+    // Пробуждения от самих add_timer к этому моменту уже прошли.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const double seconds = std::chrono::duration<double>(kIdleWindow).count();
+    const std::uint64_t before = dispatcher_wakeups();
+#ifndef _WIN32
+    rusage usage_before{};
+    getrusage(RUSAGE_SELF, &usage_before);
+#endif
+    std::this_thread::sleep_for(kIdleWindow);
+    const std::uint64_t after = dispatcher_wakeups();
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1)
+        << static_cast<double>(after - before) / seconds << " пробуждений/с";
+#ifndef _WIN32
+    rusage usage_after{};
+    getrusage(RUSAGE_SELF, &usage_after);
+    // Одно переключение — сон самого замера.
+    const long switches = usage_after.ru_nvcsw - usage_before.ru_nvcsw - 1;
+    oss << ", переключений ОС " << static_cast<double>(switches > 0 ? switches : 0) / seconds << "/с";
+#endif
+    return oss.str();
+}
+
+// Таймеры (добавление и срабатывание) в секунду для одной конфигурации TimerService.
+// Сроки раскиданы по секунде ручного времени, часы идут шагами по миллисекунде.
+// wrong — сколько таймеров сработало не так, как в движке: не сработало, сработало
+// раньше срока или позже срока больше чем на тик колеса и шаг часов.
+template <class Engine, class LockPolicy>
+double service_rate(std::size_t n, std::size_t& wrong) {
+    TimerService<Engine, ManualClock, LockPolicy> service;
+    constexpr auto kTolerance = BasicTimingWheel<ManualClock::time_point>::kTick + std::chrono::milliseconds(1);
+    std::size_t fired = 0;
+    std::size_t off = 0;
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < n; ++i) {
+        const auto after = std::chrono::milliseconds(1 + static_cast<long long>(i % 1000));
+        const auto due = service.clock().now() + after;
+        service.add(after, [&, due](TimerId, TimerOutcome outcome) {
+            ++fired;
+            const auto now = service.clock().now();
+            if (outcome != TimerOutcome::Fired || now < due || now - due > kTolerance) ++off;
+        });
+    }
+    while (service.size() > 0) {
+        service.clock().advance(std::chrono::milliseconds(1));
+        service.poll();
+    }
+    const double rate = static_cast<double>(fired) / std::chrono::duration<double>(Clock::now() - start).count();
+    wrong = std::max(wrong, off + (n - std::min(fired, n)));
+    return rate;
+}
+
+template <class Engine>
+std::string run_service(std::size_t n) {
+    // Лучшее из нескольких: первый прогон платит за первое касание памяти кучи.
+    constexpr int kRepeats = 3;
+    double unlocked = 0, locked = 0;
+    std::size_t wrong = 0;
+    for (int i = 0; i < kRepeats; ++i) {
+        unlocked = std::max(unlocked, service_rate<Engine, NoLock>(n, wrong));
+        locked = std::max(locked, service_rate<Engine, MutexLock>(n, wrong));
+    }
+
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(0)
+        << "лучшее из " << kRepeats << ", без блокировок: " << unlocked << " тайм./с"
+        << ", с мьютексом: " << locked << " тайм./с";
+    if (wrong > 0) oss << " [не по сроку " << wrong << " из " << n << "]";
+    return oss.str();
+}
+
+// Сутки трассы: n таймеров на минуты и часы, равномерно по суткам; каждый пятый
+// отменяется на середине своего срока.
+std::vector<TraceOp> day_trace(std::size_t n) {
+    constexpr std::int64_t kDayMs = 24 * 60 * 60 * 1000;
+    std::vector<TraceOp> ops;
+    ops.reserve(n + n / 5);
+    for (std::size_t i = 0; i < n; ++i) {
+        TraceOp& add = ops.emplace_back();
+        add.at = std::chrono::milliseconds(static_cast<std::int64_t>(i) * kDayMs / static_cast<std::int64_t>(n));
+        add.id = i + 1;
+        add.duration = std::chrono::seconds(60 + static_cast<long long>(i * 7919 % 7140));
+        if (i % 5 == 0) {
+            TraceOp& cancel = ops.emplace_back();
+            cancel.at = add.at + add.duration / 2;
+            cancel.kind = TraceOp::Kind::Cancel;
+            cancel.id = add.id;
+        }
+    }
+    std::stable_sort(ops.begin(), ops.end(), [](const TraceOp& a, const TraceOp& b) { return a.at < b.at; });
+    return ops;
+}
+
+std::string replay_summary(const ReplayResult& r) {
+    const std::size_t ops = r.added + r.cancelled + r.fired;
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1)
+        << std::chrono::duration<double, std::ratio<3600>>(r.span).count() << " ч за " << to_ms(r.elapsed) << " мс"
+        << ", " << (ops ? std::chrono::duration<double, std::nano>(r.elapsed).count() / static_cast<double>(ops) : 0.0)
+        << " нс/оп (добавлено " << r.added << ", отменено " << r.cancelled << ", сработало " << r.fired
+        << ", перескоков часов " << r.jumps << ")";
+    return oss.str();
+}
+
+// Выполняет один случай в текущем процессе.
+int run_case(std::string_view engine, std::string_view name, std::size_t n) {
+    g_engine = engine == "threads" ? EngineKind::Threads
+        : engine == "heap" ? EngineKind::Heap
+        : EngineKind::Wheel;
+    if (engine == "sharded" && g_shard_count == 1) {
+        g_shard_count = 0; // По числу ядер.
+    }
+    // Завершённые записи не должны копиться между замерами.
+    g_retention.keep_last = 0;
+
+    start_log();
+    std::string result;
+    if (name == "expiry") {
+        result = run_expiry(n); // Сам настраивает g_fire_hook до start_engine().
+    }
+    else if (name == "callback") {
+        result = run_expiry(n, [](TimerId, TimerOutcome) { std::this_thread::sleep_for(kSlowCallback); });
+    }
+    else {
+        start_engine();
+        if (name == "add") result = run_add(n);
+        else if (name == "cancel") result = run_cancel(n);
+        else if (name == "list") result = run_list(n);
+        else if (name == "scan") result = run_scan(n);
+        else if (name == "memory") result = run_memory(n);
+        else if (name == "flows") result = run_flows(n);
+        else if (name == "idle") result = run_idle(n);
+        else if (name == "service") {
+            result = engine == "heap" ? run_service<HeapEngine>(n) : run_service<WheelEngine>(n);
+        }
+        else if (name == "replay") result = replay_summary(replay_trace(day_trace(n), g_engine));
+        else {
+            std::cerr << "Неизвестный случай: " << name << "\n";
+            shutdown_all();
+            stop_log();
+            return 1;
+        }
+    }
+    shutdown_all();
+    stop_log();
+
+    std::string shown(engine);
+    if (g_hires) shown += "+hr";
+    if (g_slack > std::chrono::milliseconds(0)) shown += "+sl";
+    if (g_power_save) shown += "+ps";
+    report(shown, name, n, result);
+    return 0;
+}
+
+// Прогоняет весь набор, запуская каждый случай отдельным процессом.
+int run_suite(const char* self) {
+    const char* engines[] = { "wheel", "sharded", "heap", "threads" };
+    const char* cases[] = { "add", "cancel", "expiry", "callback", "list", "scan", "memory", "flows", "idle", "service", "replay" };
+    const std::size_t sizes[] = { 10, 10000, 1000000 };
+
+#ifdef _WIN32
+    const char* null_device = "NUL";
+#else
+    const char* null_device = "/dev/null";
+#endif
+
+    // setw считает байты, а не буквы, поэтому заголовок выровнен вручную.
+    std::cerr << "движок     случай    таймеров  результат\n";
+
+    int failures = 0;
+    for (const char* engine : engines) {
+        for (const char* name : cases) {
+            // Точность срабатывания имеет смысл сравнивать в высокоточном режиме и с допуском,
+            // простой — в экономном режиме. Допуска и экономного режима у threads нет.
+            struct Mode {
+                const char* suffix;
+                std::string flags;
+            };
+            std::vector<Mode> modes{ { "", "" } };
+            const bool queues = std::string_view(engine) != "threads";
+            if (std::string_view(name) == "expiry") {
+                modes.push_back({ "+hr", " --hires" });
+                if (queues) modes.push_back({ "+sl", " --slack=" + std::to_string(kSuiteSlack.count()) });
+            }
+            if (std::string_view(name) == "idle" && queues) {
+                modes.push_back({ "+ps", " --power-save" });
+            }
+            for (const Mode& mode : modes) {
+                const std::string shown = std::string(engine) + mode.suffix;
+                for (std::size_t n : sizes) {
+                    if (std::string_view(engine) == "threads" && n > kThreadsEngineLimit) {
+                        report(shown, name, n, "пропущено: слишком много потоков");
+                        continue;
+                    }
+                    if (std::string_view(name) == "callback" && n > kCallbackLimit) {
+                        report(shown, name, n, "пропущено: слишком много колбэков");
+                        continue;
+                    }
+                    if ((std::string_view(name) == "service" || std::string_view(name) == "replay") &&
+                        std::string_view(engine) != "wheel" && std::string_view(engine) != "heap") {
+                        report(shown, name, n, "пропущено: только для очередей wheel и heap");
+                        continue;
+                    }
+                    std::string cmd = std::string("\"") + self + "\" --engine=" + engine +
+                        " --case=" + name + " --n=" + std::to_string(n) + mode.flags + " > " + null_device;
+#ifdef _WIN32
+                    // cmd.exe снимает внешние кавычки, если команда с них начинается.
+                    cmd = "\"" + cmd + "\"";
+#endif
+                    if (std::system(cmd.c_str()) != 0) {
+                        report(shown, name, n, "ОШИБКА");
+                        ++failures;
+                    }
+                }
+            }
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+
+    std::string_view engine = "wheel";
+    std::string_view name;
+    std::string replay_path;
+    std::size_t n = 10000;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg.substr(0, 9) == "--engine=") {
+            engine = arg.substr(9);
+        }
+        else if (arg.substr(0, 7) == "--case=") {
+            name = arg.substr(7);
+        }
+        else if (arg == "--hires") {
+            g_hires = true;
+        }
+        else if (arg == "--power-save") {
+            g_power_save = true;
+        }
+        else if (arg.substr(0, 8) == "--slack=") {
+            g_slack = std::chrono::milliseconds(std::strtoll(std::string(arg.substr(8)).c_str(), nullptr, 10));
+        }
+        else if (arg.substr(0, 9) == "--replay=" && arg.size() > 9) {
+            replay_path = std::string(arg.substr(9));
+        }
+        else if (arg.substr(0, 9) == "--shards=") {
+            g_shard_count = static_cast<std::size_t>(std::strtoull(std::string(arg.substr(9)).c_str(), nullptr, 10));
+        }
+        else if (arg.substr(0, 4) == "--n=") {
+            n = static_cast<std::size_t>(std::strtoull(std::string(arg.substr(4)).c_str(), nullptr, 10));
+        }
+        else {
+            std::cerr << "Использование: " << argv[0]
+                << " [--engine=wheel|sharded|heap|threads]\n"
+                << "    [--case=add|cancel|expiry|callback|list|scan|memory|flows|idle|service|replay --n=N\n"
+                << "     [--hires] [--slack=<мс>] [--power-save] [--shards=N] | --replay=<трасса>]\n";
+            return 1;
+        }
+    }
+
+    if (!replay_path.empty()) {
+        std::vector<TraceOp> ops;
+        std::size_t bad = 0;
+        if (!trace_load(replay_path, ops, bad)) {
+            std::cerr << "Не удалось прочитать трассу: " << replay_path << "\n";
+            return 1;
+        }
+        if (bad > 0) {
+            std::cerr << "Пропущено строк с ошибками: " << bad << "\n";
+        }
+        std::stable_sort(ops.begin(), ops.end(), [](const TraceOp& a, const TraceOp& b) { return a.at < b.at; });
+        const EngineKind kind = engine == "heap" ? EngineKind::Heap : EngineKind::Wheel;
+        report(engine, "replay", ops.size(), replay_summary(replay_trace(ops, kind)));
+        return 0;
+    }
+    if (name.empty()) {
+        return run_suite(argv[0]);
+    }
+    return run_case(engine, name, n);
+}
@@ -1,273 +1,860 @@
-﻿#include <atomic>
-#include <chrono>
+﻿#include <algorithm>
+#include <array>
+#include <cerrno>
 #include <csignal>
-#include <iomanip>
+#include <cstdint>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <mutex>
-#include <sstream>
 #include <string>
-#include <thread>
+#include <string_view>
 #include <vector>
-#include <memory>
 #include <windows.h>
 
+#include "TimerEngine.h"
+#include "TimerReplay.h"
+#include "TimerServer.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #ifdef _WIN32
 #pragma execution_character_set("utf-8")
 #endif
 
 
-using Clock = std::chrono::steady_clock;
+// Пришёл SIGINT (Ctrl+C) или SIGTERM. Обработчик только выставляет флаг и будит
+// главный поток, а завершает приложение main: shutdown_all берёт мьютексы и ждёт
+// потоки, и из обработчика сигнала это может зависнуть навсегда.
+volatile std::sig_atomic_t g_interrupted = 0;
+#ifdef _WIN32
+HANDLE g_main_thread = nullptr; // Его блокирующее чтение stdin снимает обработчик.
+#else
+int g_wake_pipe[2] = { -1, -1 }; // Самопайп: обработчик пишет байт, ввод ждёт его через poll.
+#endif
+
+void signal_handler(int sig) {
+    const int saved_errno = errno;
+    g_interrupted = 1;
+    std::signal(sig, SIG_DFL); // Повторный сигнал завершит процесс сразу.
+#ifdef _WIN32
+    // Здесь обработчик идёт в своём потоке. Чтение консоли Ctrl+C прерывает и сам,
+    // чтение канала (--pipe) — нет.
+    CancelSynchronousIo(g_main_thread);
+#else
+    const char byte = 1;
+    const ssize_t ignored = ::write(g_wake_pipe[1], &byte, 1);
+    (void)ignored;
+#endif
+    errno = saved_errno;
+}
+
+void install_signal_handlers() {
+#ifdef _WIN32
+    DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &g_main_thread,
+        0, FALSE, DUPLICATE_SAME_ACCESS);
+#else
+    if (::pipe(g_wake_pipe) == 0) {
+        for (int fd : g_wake_pipe) {
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC); // Не достаётся командам run.
+        }
+        // Обработчик не должен блокироваться, даже если байтов накопилось много.
+        ::fcntl(g_wake_pipe[1], F_SETFL, ::fcntl(g_wake_pipe[1], F_GETFL) | O_NONBLOCK);
+    }
+#endif
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+}
 
-struct TimerInfo {
-    int id;                                     // Идентификатор таймера.
-    std::string label;                          // Имя задачи.
-    std::chrono::seconds total;                 // Длительность таймера.
-    Clock::time_point start;
-    Clock::time_point end;
+// Вывод краткой справки по доступным командам.
+void print_help() {
+    safe_print(
+        "Команды:\n"
+        "  help                          - показать помощь\n"
+        "  add <длительность> <название> - добавить таймер\n"
+        "  run <длительность> <команда>  - по срабатыванию выполнить команду оболочки\n"
+        "  every <длительность> <название>\n"
+        "                                - повторять таймер до отмены\n"
+        "  pomodoro [--repeat] <название>\n"
+        "                                - 25 мин работы, затем 5 мин перерыва (--repeat — по кругу)\n"
+        "  chain [--repeat] <длительность> <название>; <длительность> <название>; ...\n"
+        "                                - фазы одна за другой одним таймером\n"
+        "  list [running] [--limit N]    - список таймеров (только активные, не больше N строк)\n"
+        "  batch <N | файл>              - пачка таймеров: N следующих строк или файл,\n"
+        "                                  по строке \"<длительность> <название>\" на таймер\n"
+        "  cancel <id>                   - отменить таймер\n"
+        "  stats [секунды]               - статистика; с числом — печатать каждые N секунд (0 — выкл.)\n"
+        "  exit                          - выйти\n"
+        "Длительность — числа с единицами ms, s, m, h (1500ms, 1m30s, 2h); просто число — минуты.\n"
+    );
+}
 
-    std::shared_ptr<std::atomic<bool>> cancelled; // true, если таймер отменён.
-    std::shared_ptr<std::atomic<bool>> finished;  // true, если таймер успешно завершился.
-    std::thread worker;                           // Поток, отсчитывающий данный таймер.
+// Построчный ввод команд. В консоли — std::getline. В режиме --pipe stdin читается
+// большими блоками напрямую (read возвращает то, что уже есть в канале, и не ждёт
+// заполнения блока), а строки отдаются кусками буфера без копирования.
+// Чтение прерывается сигналом завершения (g_interrupted).
+class LineReader {
+public:
+    explicit LineReader(bool blocks) : blocks_(blocks) {
+#ifndef _WIN32
+        if (!blocks_) {
+            // Ждём ввода через poll по дескриптору, поэтому у stdio не должно оставаться
+            // прочитанных, но не отданных строк. Консоли побайтовое чтение не мешает.
+            std::setvbuf(stdin, nullptr, _IONBF, 0);
+        }
+#endif
+    }
+
+    // Следующая строка без '\r\n'; действительна до следующего вызова.
+    // false — ввод кончился или пришёл сигнал завершения.
+    bool next(std::string_view& line) {
+        if (!blocks_) {
+            if (!wait_input() || !std::getline(std::cin, line_)) {
+                return false;
+            }
+            line = line_;
+        }
+        else if (!next_block_line(line)) {
+            return false;
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        return true;
+    }
+
+private:
+    static constexpr std::size_t kBlock = 1 << 16;
+
+    bool next_block_line(std::string_view& line) {
+        while (true) {
+            const char* first = buf_.data() + begin_;
+            if (const void* eol = std::memchr(first, '\n', end_ - begin_)) {
+                const std::size_t size = static_cast<std::size_t>(static_cast<const char*>(eol) - first);
+                line = std::string_view(first, size);
+                begin_ += size + 1;
+                return true;
+            }
+            if (eof_) {
+                // Последняя строка без перевода строки.
+                line = std::string_view(first, end_ - begin_);
+                begin_ = end_;
+                return !line.empty();
+            }
+            // Недочитанный хвост — в начало буфера; длинная строка растит буфер.
+            std::memmove(buf_.data(), first, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+            if (buf_.size() - end_ < kBlock) {
+                buf_.resize(end_ + kBlock);
+            }
+            if (!wait_input()) {
+                return false;
+            }
+            const std::size_t got = read_stdin(buf_.data() + end_, buf_.size() - end_);
+            if (got == 0) {
+                eof_ = true;
+            }
+            end_ += got;
+        }
+    }
+
+    // Ждёт, пока в stdin появятся данные (или конец). false — пришёл сигнал завершения.
+    static bool wait_input() {
+#ifndef _WIN32
+        pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { g_wake_pipe[0], POLLIN, 0 } };
+        while (!g_interrupted) {
+            // EINTR — сигнал пришёл в этот поток; флаг уже выставлен.
+            if (::poll(fds, 2, -1) > 0 && fds[0].revents != 0) {
+                return !g_interrupted;
+            }
+        }
+#endif
+        return !g_interrupted;
+    }
+
+    static std::size_t read_stdin(char* out, std::size_t size) {
+#ifdef _WIN32
+        const int got = _read(0, out, static_cast<unsigned>(size));
+#else
+        const ssize_t got = ::read(STDIN_FILENO, out, size);
+#endif
+        return got > 0 ? static_cast<std::size_t>(got) : 0;
+    }
+
+    bool blocks_;
+    std::string line_;
+    std::vector<char> buf_ = std::vector<char>(kBlock);
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+    bool eof_ = false;
 };
 
-// Глобальный флаг работы приложения. Используется для мягкого завершения всех потоков.
-std::atomic<bool> g_running{ true };
+// Разбирает неотрицательное целое значение ключа вида --name=<число>.
+bool parse_arg_value(std::string_view arg, std::string_view name, std::uint64_t& value) {
+    if (arg.substr(0, name.size()) != name) {
+        return false;
+    }
+    std::string_view digits = arg.substr(name.size());
+    auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    return ec == std::errc() && ptr == digits.data() + digits.size() && !digits.empty();
+}
+
+// Разбирает длительность: числа с единицами ms, s, m, h подряд ("1m30s" — как печатает
+// append_duration); одно число без единицы — минуты. false — ошибка, ноль или больше
+// миллиарда минут.
+bool parse_duration(std::string_view text, std::chrono::milliseconds& out) {
+    constexpr std::uint64_t kMaxMs = std::uint64_t{ 1000000000 } * 60 * 1000;
+    const char* ptr = text.data();
+    const char* const last = text.data() + text.size();
+    std::uint64_t total = 0;
+    do {
+        std::uint64_t value = 0;
+        auto [next, ec] = std::from_chars(ptr, last, value);
+        if (ec != std::errc()) {
+            return false;
+        }
+        // Единица — буквы до следующей цифры; без единицы — минуты, но только у числа целиком.
+        const char* unit_end = next;
+        while (unit_end != last && (*unit_end < '0' || *unit_end > '9')) ++unit_end;
+        const std::string_view unit(next, static_cast<std::size_t>(unit_end - next));
+        std::uint64_t unit_ms = 0;
+        if (unit == "m" || (unit.empty() && ptr == text.data())) unit_ms = 60 * 1000;
+        else if (unit == "ms") unit_ms = 1;
+        else if (unit == "s") unit_ms = 1000;
+        else if (unit == "h") unit_ms = 60 * 60 * 1000;
+        else return false;
+        if (value > (kMaxMs - total) / unit_ms) {
+            return false;
+        }
+        total += value * unit_ms;
+        ptr = unit_end;
+    } while (ptr != last);
+    if (total == 0) {
+        return false;
+    }
+    out = std::chrono::milliseconds(static_cast<std::chrono::milliseconds::rep>(total));
+    return true;
+}
 
-// Мьютекс для синхронизации вывода в консоль.
-std::mutex g_cout_mutex;
+// Разбирает строку пачки "<длительность> <название>" и дописывает таймер в specs.
+// Пустые строки и комментарии (#...) пропускаются. false — строка с ошибкой.
+bool parse_batch_line(std::string_view line, std::vector<TimerSpec>& specs) {
+    // Строки из LineReader уже без '\r', строки файла — нет.
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    const std::size_t begin = line.find_first_not_of(' ');
+    if (begin == std::string_view::npos || line[begin] == '#') {
+        return true;
+    }
+    line.remove_prefix(begin);
 
-// Мьютекс для защиты контейнера с таймерами.
-std::mutex g_timers_mutex;
+    const std::size_t space = line.find(' ');
+    std::chrono::milliseconds duration{ 0 };
+    if (!parse_duration(line.substr(0, space), duration)) {
+        return false;
+    }
+    std::string_view label = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
 
-// Хранилище всех таймеров (как активных, так и завершённых/отменённых).
-std::vector<TimerInfo> g_timers;
+    TimerSpec& spec = specs.emplace_back();
+    spec.duration = duration;
+    spec.label = label;
+    return true;
+}
 
-// Вывод в консоль. 
-void safe_print(const std::string& msg) {
-    std::lock_guard<std::mutex> lock(g_cout_mutex);
-    std::cout << msg << std::flush;
+#ifndef _WIN32
+// Выполняющиеся команды run. По сигналу завершения их останавливают (stop_children),
+// чтобы shutdown_all не ждал их в пуле исполнителей.
+// После stop_children новые команды не запускаются.
+std::mutex g_children_mutex;
+std::vector<pid_t> g_children;
+bool g_children_stopped = false;
+
+void stop_children() {
+    std::lock_guard<std::mutex> lock(g_children_mutex);
+    g_children_stopped = true;
+    for (pid_t child : g_children) {
+        ::kill(-child, SIGTERM); // Всей группе: оболочка могла запустить свои процессы.
+    }
 }
+#endif
 
-// Корректный вид для чтения
-std::string format_duration(std::chrono::seconds s) {
-    auto total = s.count();
-    if (total < 0) total = 0;
-    int m = static_cast<int>(total / 60);
-    int sec = static_cast<int>(total % 60);
-    std::ostringstream oss;
-    if (m > 0) {
-        oss << m << "m";
-        if (sec > 0) oss << sec << "s";
+// Колбэк таймера run: выполняет команду оболочки в пуле исполнителей движка и
+// сообщает код возврата: "[EXIT] #<id> "<команда>" код <N>", в Pipe — "EXIT\t<id>\t<код>\t<команда>".
+// В Pipe вывод команды уходит в null-устройство, чтобы не разорвать строки ответов.
+void run_command(TimerId id, const std::string& command) {
+    const bool pipe = g_output == OutputFormat::Pipe;
+#ifdef _WIN32
+    const int code = std::system(pipe ? (command + " > NUL").c_str() : command.c_str());
+#else
+    // Не std::system: тот на время команды отключает SIGINT во всём процессе.
+    // stdin команде не достаётся: он занят командами таймера. Команда — в своей группе
+    // процессов, чтобы stop_children остановил её вместе с потомками.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (pipe) {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    }
+    char* const argv[] = { const_cast<char*>("sh"), const_cast<char*>("-c"), const_cast<char*>(command.c_str()), nullptr };
+    int code = -1;
+    pid_t child = 0;
+    bool spawned = false;
+    {
+        std::lock_guard<std::mutex> lock(g_children_mutex);
+        if (g_children_stopped) {
+            posix_spawn_file_actions_destroy(&actions);
+            posix_spawnattr_destroy(&attr);
+            return;
+        }
+        spawned = posix_spawn(&child, "/bin/sh", &actions, &attr, argv, environ) == 0;
+        if (spawned) {
+            g_children.push_back(child);
+        }
+    }
+    if (spawned) {
+        int status = 0;
+        while (::waitpid(child, &status, 0) < 0 && errno == EINTR) {
+        }
+        {
+            std::lock_guard<std::mutex> lock(g_children_mutex);
+            std::erase(g_children, child);
+        }
+        // Как в оболочке: убитая сигналом команда — 128 + номер сигнала.
+        code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+#endif
+    std::string msg;
+    if (pipe) {
+        msg = "EXIT\t" + std::to_string(id) + "\t" + std::to_string(code) + "\t" + command + "\n";
     }
     else {
-        oss << sec << "s";
+        msg = "[EXIT]  #" + std::to_string(id) + " \"" + command + "\" код " + std::to_string(code) + "\n";
     }
-    return oss.str();
+    log_event(msg);
 }
 
-// Функция, выполняющаяся в отдельном потоке для конкретного таймера.
-// Отсчитывает время до end, реагирует на отмену и глобальное завершение.
-void timer_thread_func(
-    int id,
-    std::string label,
-    Clock::time_point /*start*/,  // start не используется внутри, но хранится в TimerInfo.
-    Clock::time_point end,
-    std::shared_ptr<std::atomic<bool>> cancelled,
-    std::shared_ptr<std::atomic<bool>> finished
-) {
-    using namespace std::chrono;
+// Снимает ключ --repeat в начале аргументов команды.
+bool take_repeat_flag(std::string_view& args) {
+    constexpr std::string_view flag = "--repeat";
+    if (args.substr(0, flag.size()) != flag || (args.size() > flag.size() && args[flag.size()] != ' ')) {
+        return false;
+    }
+    args.remove_prefix(args.size() > flag.size() ? flag.size() + 1 : flag.size());
+    return true;
+}
 
-    // Проверяем, не закончился ли таймер,
-    // не отменён ли он и не завершено ли приложение.
-    while (g_running.load(std::memory_order_relaxed) &&
-        !cancelled->load(std::memory_order_relaxed)) {
+// Читает файл целиком.
+bool read_file(const std::string& path, std::string& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    in.seekg(0, std::ios::end);
+    out.resize(static_cast<std::size_t>(in.tellg()));
+    in.seekg(0, std::ios::beg);
+    in.read(out.data(), static_cast<std::streamsize>(out.size()));
+    return static_cast<bool>(in);
+}
 
-        auto now = Clock::now();
-        if (now >= end) {
-            break;
-        }
+// Следующая строка ввода команд; false — ввод кончился.
+using NextLine = std::function<bool(std::string_view& line)>;
 
-        auto remaining = duration_cast<seconds>(end - now);
-        if (remaining <= seconds(0)) {
-            break;
-        }
+// Больше строк batch N не забирает: соединение сервера держит их в буфере до конца пачки.
+constexpr std::uint64_t kMaxBatchLines = std::uint64_t{ 1 } << 20;
 
-        // Спим шагами, чтобы быстрее реагировать на отмену/выход.
-        auto step = remaining > seconds(1) ? seconds(1) : remaining;
-        std::this_thread::sleep_for(step);
+// Команда batch: сначала разбирает все строки, потом добавляет их одной пачкой.
+void add_batch(std::vector<TimerSpec>& specs, std::size_t bad) {
+    add_timers(specs);
+    if (bad > 0) {
+        print_error("bad_lines", "Пропущено строк с ошибками: " + std::to_string(bad) + "\n", std::to_string(bad));
     }
+}
 
-    // Если приложение останавливается или таймер отменён — выходим тихо.
-    if (!g_running.load(std::memory_order_relaxed) ||
-        cancelled->load(std::memory_order_relaxed)) {
+// batch N: следующие count строк ввода.
+void run_batch_lines(std::size_t count, const NextLine& next_line) {
+    std::vector<TimerSpec> specs;
+    std::size_t bad = 0;
+    specs.reserve(count);
+    std::string_view line;
+    for (std::size_t i = 0; i < count && next_line(line); ++i) {
+        if (!parse_batch_line(line, specs)) ++bad;
+    }
+    add_batch(specs, bad);
+}
+
+// batch <файл>: по строке на таймер.
+void run_batch_file(const std::string& path) {
+    std::string data;
+    if (!read_file(path, data)) {
+        print_error("read_failed", "Не удалось прочитать файл: " + path + "\n", path);
         return;
     }
+    std::vector<TimerSpec> specs;
+    std::size_t bad = 0;
+    std::string_view rest = data;
+    while (!rest.empty()) {
+        const std::size_t eol = rest.find('\n');
+        if (!parse_batch_line(rest.substr(0, eol), specs)) ++bad;
+        rest.remove_prefix(eol == std::string_view::npos ? rest.size() : eol + 1);
+    }
+    add_batch(specs, bad);
+}
 
-    // Помечаем таймер как успешно завершённый.
-    finished->store(true, std::memory_order_relaxed);
+// Разбор строки команды без копирования: слова — через пробелы и табуляции,
+// числа — std::from_chars. Всё выданное указывает в исходную строку.
+class CommandArgs {
+public:
+    explicit CommandArgs(std::string_view line) : rest_(line) {}
+
+    // Следующее слово; пусто — слова кончились.
+    std::string_view word() {
+        const std::size_t begin = rest_.find_first_not_of(kBlanks);
+        if (begin == std::string_view::npos) {
+            rest_ = {};
+            return {};
+        }
+        rest_.remove_prefix(begin);
+        const std::size_t end = std::min(rest_.find_first_of(kBlanks), rest_.size());
+        const std::string_view result = rest_.substr(0, end);
+        rest_.remove_prefix(end);
+        return result;
+    }
 
-    // Сообщаем о завершении.
-    std::ostringstream oss;
-    oss << "[DONE]  #" << id << " \"" << label << "\"\n";
-    safe_print(oss.str());
-}
+    // Следующее слово, если оно целиком — число.
+    template <class T>
+    bool number(T& value) {
+        const std::string_view text = word();
+        auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        return !text.empty() && ec == std::errc() && ptr == text.data() + text.size();
+    }
 
-// Создаёт новый таймер и запускет для него поток.
-// Возвращает id созданного таймера или -1 в случае ошибки.
-int add_timer(std::chrono::seconds duration, const std::string& label) {
-    if (duration <= std::chrono::seconds(0)) {
-        safe_print("Длительность должна быть > 0.\n");
-        return -1;
+    // Остаток строки без одного пробела после предыдущего слова: названия и команды
+    // оболочки берутся как есть, со своими пробелами.
+    std::string_view tail() {
+        std::string_view result = rest_;
+        if (!result.empty() && result.front() == ' ') {
+            result.remove_prefix(1);
+        }
+        rest_ = {};
+        return result;
     }
 
-    // счётчик id
-    static int next_id = 1;
+private:
+    static constexpr std::string_view kBlanks = " \t\r\n\v\f";
+    std::string_view rest_;
+};
 
-    TimerInfo t;
-    t.id = next_id++;
-    t.label = label.empty() ? "Без названия" : label;
-    t.total = duration;
-    t.start = Clock::now();
-    t.end = t.start + duration;
-    t.cancelled = std::make_shared<std::atomic<bool>>(false);
-    t.finished = std::make_shared<std::atomic<bool>>(false);
+// Аргументы batch — одно число и больше ничего (иначе это имя файла). Один разбор и
+// для команды, и для batch_line_count сервера: строки пачки они считают одинаково.
+bool batch_count(CommandArgs args, std::uint64_t& count) {
+    return args.number(count) && args.word().empty();
+}
 
-    {
-        // Под защитой мьютекса добавляем таймер в общий контейнер
-        // и сразу привязываем к нему поток.
-        std::lock_guard<std::mutex> lock(g_timers_mutex);
-        t.worker = std::thread(
-            timer_thread_func,
-            t.id,
-            t.label,
-            t.start,
-            t.end,
-            t.cancelled,
-            t.finished
-        );
-        g_timers.emplace_back(std::move(t));
-    }
-
-    std::ostringstream oss;
-    oss << "[ADD]  #" << (next_id - 1)
-        << " \"" << (label.empty() ? "Без названия" : label)
-        << "\" на " << format_duration(duration) << "\n";
-    safe_print(oss.str());
-
-    return next_id - 1;
-}
-
-// Выводит список всех таймеров и их состояние.
-void list_timers() {
-    std::lock_guard<std::mutex> lock(g_timers_mutex);
-
-    if (g_timers.empty()) {
-        safe_print("Активных/завершённых таймеров нет.\n");
-        return;
+// Откуда пришла команда. Недоверенный источник — соединение сервера без --allow-run:
+// ему не дают запускать команды оболочки (run) и читать локальные файлы (batch <файл>).
+struct CommandSource {
+    const NextLine& next_line; // Следующие строки того же источника (для batch N).
+    bool trusted;
+};
+
+// Команды. Аргументы — после имени команды; false — команда exit.
+bool command_help(CommandArgs&, const CommandSource&) {
+    print_help();
+    return true;
+}
+
+bool command_add(CommandArgs& args, const CommandSource&) {
+    std::chrono::milliseconds duration{ 0 };
+    if (!parse_duration(args.word(), duration)) {
+        print_error("usage", "Использование: add <длительность> <название>\n", "add");
+        return true;
     }
+    trace_add(add_timer(duration, args.tail()), duration);
+    return true;
+}
 
-    std::ostringstream oss;
-    oss << "Таймеры:\n";
+bool command_run(CommandArgs& args, const CommandSource&) {
+    std::chrono::milliseconds duration{ 0 };
+    std::string command;
+    if (parse_duration(args.word(), duration)) {
+        command = args.tail();
+    }
+    if (command.empty()) {
+        print_error("usage", "Использование: run <длительность> <команда>\n", "run");
+        return true;
+    }
+    const TimerId id = add_timer(duration, command, [command](TimerId id, TimerOutcome outcome) {
+        if (outcome == TimerOutcome::Fired) {
+            run_command(id, command);
+        }
+    });
+    trace_add(id, duration);
+    return true;
+}
 
-    auto now = Clock::now();
-    for (const auto& t : g_timers) {
-        bool cancelled = t.cancelled->load(std::memory_order_relaxed);
-        bool finished = t.finished->load(std::memory_order_relaxed);
+bool command_every(CommandArgs& args, const CommandSource&) {
+    std::chrono::milliseconds duration{ 0 };
+    if (!parse_duration(args.word(), duration)) {
+        print_error("usage", "Использование: every <длительность> <название>\n", "every");
+        return true;
+    }
+    std::vector<TimerSpec> phases(1);
+    phases[0].duration = duration;
+    phases[0].label = args.tail();
+    add_chain(std::move(phases), true);
+    return true;
+}
+
+bool command_pomodoro(CommandArgs& args, const CommandSource&) {
+    std::string_view label = args.tail();
+    const bool repeat = take_repeat_flag(label);
+    if (label.empty())
+        label = "Pomodoro";
+
+    // Pomodoro: 25 минут работы, затем 5 минут перерыва — одним таймером,
+    // перерыв начинается, когда закончилась работа.
+    std::vector<TimerSpec> phases(2);
+    phases[0].duration = std::chrono::minutes(25);
+    phases[0].label = "Work: ";
+    phases[0].label += label;
+    phases[1].duration = std::chrono::minutes(5);
+    phases[1].label = "Break after: ";
+    phases[1].label += label;
+    add_chain(std::move(phases), repeat);
+    return true;
+}
+
+bool command_chain(CommandArgs& args, const CommandSource&) {
+    std::string_view phases_text = args.tail();
+    const bool repeat = take_repeat_flag(phases_text);
+
+    // Фазы через ';', каждая — как строка пачки: "<длительность> <название>".
+    std::vector<TimerSpec> phases;
+    bool ok = true;
+    while (ok && !phases_text.empty()) {
+        const std::size_t sep = phases_text.find(';');
+        std::string_view phase = phases_text.substr(0, sep);
+        phase.remove_suffix(phase.size() - (phase.find_last_not_of(' ') + 1));
+        const std::size_t before = phases.size();
+        ok = parse_batch_line(phase, phases) && phases.size() > before;
+        phases_text.remove_prefix(sep == std::string_view::npos ? phases_text.size() : sep + 1);
+    }
+    if (!ok || phases.empty()) {
+        print_error("usage", "Использование: chain [--repeat] <длительность> <название>; ...\n", "chain");
+        return true;
+    }
+    add_chain(std::move(phases), repeat);
+    return true;
+}
 
-        oss << "  #" << t.id << " \"" << t.label << "\" ";
+bool command_batch(CommandArgs& args, const CommandSource& from) {
+    std::uint64_t count = 0;
+    if (batch_count(args, count)) {
+        if (count > kMaxBatchLines) {
+            print_error("usage", "batch N: не больше " + std::to_string(kMaxBatchLines) + " строк\n", "batch");
+            return true;
+        }
+        run_batch_lines(static_cast<std::size_t>(count), from.next_line);
+        return true;
+    }
+    const std::string path(args.tail());
+    if (path.empty()) {
+        print_error("usage", "Использование: batch <N | файл>\n", "batch");
+        return true;
+    }
+    if (!from.trusted) {
+        print_error("forbidden", "batch <файл> по сети недоступен (см. --allow-run).\n", "batch");
+        return true;
+    }
+    run_batch_file(path);
+    return true;
+}
 
-        if (cancelled) {
-            oss << "[CANCELLED]";
+bool command_list(CommandArgs& args, const CommandSource&) {
+    ListFilter filter;
+    bool ok = true;
+    for (std::string_view word = args.word(); ok && !word.empty(); word = args.word()) {
+        if (word == "running") {
+            filter.running_only = true;
         }
-        else if (finished) {
-            oss << "[DONE]";
+        else if (word == "--limit") {
+            ok = args.number(filter.limit);
         }
         else {
-            if (now >= t.end) {
-                // таймер уже должен был сработать, но поток ещё не отметил finished.
-                oss << "[PENDING DONE]";
-            }
-            else {
-                auto remaining = std::chrono::duration_cast<std::chrono::seconds>(t.end - now);
-                oss << "[RUNNING, осталось " << format_duration(remaining) << "]";
-            }
+            ok = false;
         }
+    }
+    if (!ok) {
+        print_error("usage", "Использование: list [running] [--limit N]\n", "list");
+        return true;
+    }
+    list_timers(filter);
+    return true;
+}
 
-        oss << "\n";
+bool command_cancel(CommandArgs& args, const CommandSource&) {
+    TimerId id = 0;
+    if (!args.number(id)) {
+        print_error("usage", "Использование: cancel <id>\n", "cancel");
+        return true;
     }
+    trace_cancel(id);
+    cancel_timer(id);
+    return true;
+}
 
-    safe_print(oss.str());
+bool command_stats(CommandArgs& args, const CommandSource&) {
+    if (CommandArgs(args).word().empty()) {
+        print_stats();
+        return true;
+    }
+    int seconds = 0;
+    if (!args.number(seconds) || seconds < 0 || !args.word().empty()) {
+        print_error("usage", "Использование: stats [секунды]\n", "stats");
+        return true;
+    }
+    set_stats_every(std::chrono::seconds(seconds));
+    return true;
 }
 
-// Отмена конкретного таймера по id.
-// Для простоты join вызывается под мьютексом;
-void cancel_timer(int id) {
-    std::lock_guard<std::mutex> lock(g_timers_mutex);
+bool command_exit(CommandArgs&, const CommandSource&) {
+    return false;
+}
 
-    for (auto& t : g_timers) {
-        if (t.id == id) {
-            if (t.cancelled->load() || t.finished->load()) {
-                safe_print("Таймер уже завершён или отменён.\n");
-                return;
-            }
+using CommandFn = bool (*)(CommandArgs& args, const CommandSource& from);
 
-            t.cancelled->store(true);
-            if (t.worker.joinable()) {
-                t.worker.join();
-            }
+struct CommandEntry {
+    std::string_view name;
+    CommandFn run;
+    bool trusted_only = false; // Только для доверенного источника (см. CommandSource).
+};
 
-            std::ostringstream oss;
-            oss << "[CANCEL] #" << id << " \"" << t.label << "\"\n";
-            safe_print(oss.str());
-            return;
-        }
-    }
+// Все команды. Новая команда — строка здесь и в print_help; если её имя попадёт
+// в занятую ячейку command_slot, сборка остановится на static_assert ниже.
+constexpr CommandEntry kCommands[] = {
+    { "help", command_help },
+    { "add", command_add },
+    { "run", command_run, true },
+    { "every", command_every },
+    { "pomodoro", command_pomodoro },
+    { "chain", command_chain },
+    { "batch", command_batch },
+    { "list", command_list },
+    { "cancel", command_cancel },
+    { "stats", command_stats },
+    { "exit", command_exit },
+};
 
-    safe_print("Таймер с таким id не найден.\n");
+// Совершенный хеш имён команд: длина, первая и последняя буквы — у нынешних команд
+// ячейки не совпадают. Ищется одним вычислением и одним сравнением строк.
+constexpr std::size_t kCommandSlots = 32;
+
+constexpr std::size_t command_slot(std::string_view name) {
+    return (name.size() + 2 * static_cast<unsigned char>(name.front()) + static_cast<unsigned char>(name.back())) %
+        kCommandSlots;
 }
 
-// Останавливает приложение и корректно завершает все таймеры.
-// Вызывается при выходе из main и из обработчика сигнала.
-void shutdown_all() {
-    g_running.store(false);
+// Ячейка -> номер в kCommands; -1 — пусто. Совпавшие ячейки складываются в -2.
+constexpr std::array<std::int8_t, kCommandSlots> make_command_index() {
+    std::array<std::int8_t, kCommandSlots> index{};
+    index.fill(-1);
+    for (std::size_t i = 0; i < std::size(kCommands); ++i) {
+        std::int8_t& slot = index[command_slot(kCommands[i].name)];
+        slot = slot == -1 ? static_cast<std::int8_t>(i) : std::int8_t{ -2 };
+    }
+    return index;
+}
 
-    std::lock_guard<std::mutex> lock(g_timers_mutex);
+constexpr std::array<std::int8_t, kCommandSlots> kCommandIndex = make_command_index();
 
-    // Запрашиваем отмену всех таймеров.
-    for (auto& t : g_timers) {
-        t.cancelled->store(true);
+constexpr bool command_slots_unique() {
+    for (std::int8_t slot : kCommandIndex) {
+        if (slot == -2) return false;
     }
+    return true;
+}
+static_assert(command_slots_unique(), "command_slot: у двух команд одна ячейка, поменяйте множители");
 
-    // Дожидаемся завершения всех потоков.
-    for (auto& t : g_timers) {
-        if (t.worker.joinable()) {
-            t.worker.join();
-        }
+const CommandEntry* find_command(std::string_view name) {
+    const std::int8_t i = kCommandIndex[command_slot(name)];
+    return i >= 0 && kCommands[i].name == name ? &kCommands[i] : nullptr;
+}
+
+// Выполняет строку команды; ответы — через safe_print/print_error/log_event вызвавшего
+// потока. false — команда exit.
+bool execute_from(std::string_view line, const CommandSource& from) {
+    CommandArgs args(line);
+    const std::string_view cmd = args.word();
+    if (cmd.empty()) {
+        return true;
     }
+    const CommandEntry* command = find_command(cmd);
+    if (!command) {
+        print_error("unknown_command", "Неизвестная команда. Напишите help.\n", cmd);
+        return true;
+    }
+    if (command->trusted_only && !from.trusted) {
+        print_error("forbidden", "Команда недоступна по сети (см. --allow-run).\n", cmd);
+        return true;
+    }
+    return command->run(args, from);
 }
 
-// Обработчик SIGINT (Ctrl+C).
-// Позволяет корректно завершить приложение и все потоки.
-void signal_handler(int) {
-    safe_print("\nПолучен сигнал, завершаем...\n");
-    shutdown_all();
-    std::exit(0);
+// Команда с локального ввода. next_line — следующие строки того же ввода (для batch N).
+bool execute_command(std::string_view line, const NextLine& next_line) {
+    return execute_from(line, CommandSource{ next_line, true });
 }
 
-// Вывод краткой справки по доступным командам.
-void print_help() {
-    safe_print(
-        "Команды:\n"
-        "  help                          - показать помощь\n"
-        "  add <минуты> <название>      - добавить таймер\n"
-        "  pomodoro <название>          - 25 мин работы + 5 мин перерыв\n"
-        "  list                          - список таймеров\n"
-        "  cancel <id>                   - отменить таймер\n"
-        "  exit                          - выйти\n"
-    );
+// --allow-run: соединениям сервера можно всё, что и локальному вводу.
+bool g_allow_run = false;
+
+// Команда из соединения сервера.
+bool execute_remote_command(std::string_view line, const NextLine& next_line) {
+    return execute_from(line, CommandSource{ next_line, g_allow_run });
+}
+
+// Сколько следующих строк забирает команда: у "batch N" — N, у остальных — ни одной.
+// N сверх kMaxBatchLines команда отклоняет, не забирая строк, — и здесь 0.
+std::size_t batch_line_count(std::string_view line) {
+    CommandArgs args(line);
+    std::uint64_t count = 0;
+    if (args.word() != "batch" || !batch_count(args, count) || count > kMaxBatchLines) {
+        return 0;
+    }
+    return static_cast<std::size_t>(count);
 }
 
-int main() {
+// --listen: адрес сервера; пусто — команды из stdin. На Windows server_start его отклоняет.
+std::string g_listen_address;
+std::size_t g_server_threads = 0; // --io-threads; 0 — по умолчанию сервера.
+bool g_allow_remote = false;       // --allow-remote: можно слушать не только loopback.
+
+// В режиме сервера stdin не читается: ждём SIGINT/SIGTERM.
+void wait_for_signal() {
+#ifdef _WIN32
+    while (!g_interrupted) {
+        Sleep(100);
+    }
+#else
+    pollfd fd = { g_wake_pipe[0], POLLIN, 0 };
+    while (!g_interrupted) {
+        ::poll(&fd, 1, g_wake_pipe[0] >= 0 ? -1 : 100);
+    }
+#endif
+}
+
+// Разбор ключей командной строки. Возвращает false при неизвестном ключе.
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        std::uint64_t value = 0;
+        if (arg == "--engine=wheel") {
+            g_engine = EngineKind::Wheel;
+        }
+        else if (arg == "--engine=heap") {
+            g_engine = EngineKind::Heap;
+        }
+        else if (arg == "--engine=threads") {
+            g_engine = EngineKind::Threads;
+        }
+        else if (parse_arg_value(arg, "--shards=", value) && value <= kMaxShards) {
+            g_shard_count = static_cast<std::size_t>(value); // 0 — по числу ядер.
+        }
+        else if (parse_arg_value(arg, "--workers=", value)) {
+            g_executor_threads = static_cast<std::size_t>(value); // 0 — по числу ядер.
+        }
+        else if (parse_arg_value(arg, "--keep=", value)) {
+            g_retention.keep_last = static_cast<std::size_t>(value);
+        }
+        else if (parse_arg_value(arg, "--keep-for=", value)) {
+            g_retention.keep_for = std::chrono::seconds(value);
+        }
+        else if (arg.substr(0, 6) == "--log=") {
+            g_log_file.open(std::string(arg.substr(6)), std::ios::app);
+            if (!g_log_file) {
+                std::cerr << "Не удалось открыть журнал событий: " << arg.substr(6) << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--power-save") {
+            g_power_save = true;
+        }
+        else if (parse_arg_value(arg, "--power-save=", value)) {
+            g_power_save = true;
+            g_power_tolerance = std::chrono::milliseconds(value);
+        }
+        else if (parse_arg_value(arg, "--slack=", value)) {
+            g_slack = std::chrono::milliseconds(value);
+        }
+        else if (parse_arg_value(arg, "--stats-every=", value)) {
+            g_stats_every = std::chrono::seconds(value);
+        }
+        else if (arg.substr(0, 10) == "--journal=" && arg.size() > 10) {
+            g_journal_path = std::string(arg.substr(10));
+        }
+        else if (arg == "--log-drop") {
+            g_log_drop = true;
+        }
+        else if (arg == "--hires") {
+            g_hires = true;
+        }
+        else if (arg == "--pipe") {
+            g_output = OutputFormat::Pipe;
+        }
+        else if (arg.substr(0, 9) == "--listen=" && arg.size() > 9) {
+            g_listen_address = std::string(arg.substr(9));
+            g_output = OutputFormat::Pipe; // Ответы клиентам — строками --pipe.
+        }
+        else if (arg == "--allow-remote") {
+            g_allow_remote = true;
+        }
+        else if (arg == "--allow-run") {
+            g_allow_run = true;
+        }
+        else if (parse_arg_value(arg, "--io-threads=", value) && value > 0) {
+            g_server_threads = static_cast<std::size_t>(value);
+        }
+        else if (arg.substr(0, 8) == "--trace=" && arg.size() > 8) {
+            if (!trace_open(std::string(arg.substr(8)))) {
+                std::cerr << "Не удалось открыть трассу: " << arg.substr(8) << "\n";
+                return false;
+            }
+        }
+        else {
+            std::cerr << "Неизвестный ключ: " << arg << "\n"
+                << "Использование: [--engine=wheel|heap|threads] [--shards=N] [--workers=N]\n"
+                << "               [--keep=N] [--keep-for=<секунды>]\n"
+                << "               [--log=<файл>] [--log-drop] [--stats-every=<секунды>]\n"
+                << "               [--journal=<файл>] [--trace=<файл>] [--pipe] [--hires] [--slack=<мс>]\n"
+                << "               [--power-save[=<мс>]]\n"
+                << "               [--listen=[<адрес>:]<порт> [--io-threads=N] [--allow-remote] [--allow-run]]\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
 
 #ifdef _WIN32
     SetConsoleOutputCP(CP_UTF8);
@@ -275,84 +862,84 @@ int main() {
 #endif
 
 
-    // обработчик Ctrl+C 
-    std::signal(SIGINT, signal_handler);
+    if (!parse_args(argc, argv)) {
+        return 1;
+    }
 
-    safe_print("MultiTimer (многопоточный C++ таймер)\n");
-    print_help();
+    // Ctrl+C и SIGTERM
+    install_signal_handlers();
 
-    std::string line;
-    while (g_running.load()) {
-        {
-            // Выводим приглашение к вводу. Под мьютексом, чтобы не смешивать с другими выводами.
-            std::lock_guard<std::mutex> lock(g_cout_mutex);
-            std::cout << "> " << std::flush;
-        }
+    const bool serving = !g_listen_address.empty();
+    if (serving) {
+        g_event_hook = server_broadcast; // До start_engine: события идут подписчикам.
+    }
+    start_log();
+    start_engine();
 
-        if (!std::getline(std::cin, line)) {
-            // EOF или ошибка ввода — выходим из цикла.
-            break;
-        }
+    // В --pipe команды приходят от другой программы: без заставки и приглашений,
+    // ответы и события — строками с полями через табуляцию (OutputFormat::Pipe).
+    const bool pipe = g_output == OutputFormat::Pipe;
+    if (pipe) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    }
+    else {
+        safe_print("MultiTimer (многопоточный C++ таймер)\n");
+        print_help();
+    }
 
-        std::istringstream iss(line);
-        std::string cmd;
-        iss >> cmd;
-        if (cmd.empty()) {
-            continue;
+    bool failed = false;
+    if (serving) {
+        // Команды приходят по сети; сервер останавливается до движка, чтобы команды
+        // не шли в уже остановленный движок.
+        CommandHandler handler;
+        handler.extra_lines = batch_line_count;
+        handler.execute = execute_remote_command;
+        failed = !server_start(g_listen_address, g_server_threads, std::move(handler), g_allow_remote);
+        if (!failed) {
+            wait_for_signal();
         }
+        server_stop();
+    }
+    else {
+        LineReader input(pipe);
+        std::string_view line;
+        while (g_running.load()) {
+            // Выводим приглашение к вводу через ту же очередь, чтобы не смешивать с другими выводами.
+            if (!pipe) {
+                safe_print("> ");
+            }
 
-        if (cmd == "help") {
-            print_help();
-        }
-        else if (cmd == "add") {
-            int minutes;
-            iss >> minutes;
-            if (!iss || minutes <= 0) {
-                safe_print("Использование: add <минуты> <название>\n");
-                continue;
+            if (!input.next(line)) {
+                // EOF или ошибка ввода — выходим из цикла.
+                break;
             }
 
-            std::string label;
-            std::getline(iss, label);
-            if (!label.empty() && label[0] == ' ')
-                label.erase(0, 1);
-
-            add_timer(std::chrono::seconds(minutes * 60), label);
-        }
-        else if (cmd == "pomodoro") {
-            std::string label;
-            std::getline(iss, label);
-            if (!label.empty() && label[0] == ' ')
-                label.erase(0, 1);
-            if (label.empty())
-                label = "Pomodoro";
-
-            // Pomodoro: 25 минут работы + 5 минут перерыва.
-            add_timer(std::chrono::seconds(25 * 60), "Work: " + label);
-            add_timer(std::chrono::seconds(5 * 60), "Break after: " + label);
-        }
-        else if (cmd == "list") {
-            list_timers();
-        }
-        else if (cmd == "cancel") {
-            int id;
-            iss >> id;
-            if (!iss) {
-                safe_print("Использование: cancel <id>\n");
-                continue;
+            if (!execute_command(line, [&input](std::string_view& next) { return input.next(next); })) {
+                break;
             }
-            cancel_timer(id);
-        }
-        else if (cmd == "exit") {
-            break;
-        }
-        else {
-            safe_print("Неизвестная команда. Напишите help.\n");
         }
     }
 
-    // Завершение всех потоков при выходе
-    shutdown_all();
-    safe_print("Выход.\n");
-    return 0;
+    // Завершение всех потоков при выходе. По сигналу — без уже поставленных колбэков
+    // и со снимком журнала, чтобы следующий запуск поднялся быстро.
+    if (g_interrupted) {
+        if (!pipe) {
+            safe_print("\nПолучен сигнал, завершаем...\n");
+        }
+#ifndef _WIN32
+        stop_children();
+#endif
+        shutdown_all(ShutdownMode::Fast, true);
+    }
+    else {
+        shutdown_all();
+    }
+    trace_close();
+    if (!pipe) {
+        safe_print("Выход.\n");
+    }
+    stop_log();
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,84 @@
+﻿#include "TimerCoroutine.h"
+
+#include <utility>
+
+#ifdef _WIN32
+#pragma execution_character_set("utf-8")
+#endif
+
+void TimerFlow::promise_type::unhandled_exception() {
+    // Сценарий идёт в пуле исполнителей: исключение не должно уронить его поток.
+    print_error("flow_failed", "Сценарий таймеров завершился исключением.\n");
+}
+
+// Приостановленная корутина, которую держит колбэк таймера. Колбэк, уничтоженный так и
+// не вызванным (таймер ждал при shutdown_all), уничтожает и кадр, иначе тот бы утёк.
+// Копии колбэка делят одну SuspendedFrame, так что кадр уничтожается один раз.
+class SuspendedFrame {
+public:
+    explicit SuspendedFrame(std::coroutine_handle<> handle) : handle_(handle) {}
+    SuspendedFrame(const SuspendedFrame&) = delete;
+    SuspendedFrame& operator=(const SuspendedFrame&) = delete;
+    ~SuspendedFrame() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    void resume() { std::exchange(handle_, nullptr).resume(); }
+    // Корутину продолжит сам suspend: колбэк так и не был заведён.
+    void release() { handle_ = nullptr; }
+
+private:
+    std::coroutine_handle<> handle_;
+};
+
+void TimerFlow::cancel() const {
+    if (!state_) {
+        return;
+    }
+    // Пара к suspend: флаг ставится до чтения current, а там current пишется до чтения
+    // флага, так что хотя бы одна сторона увидит другую и ожидание будет отменено.
+    state_->cancelled.store(true);
+    const TimerId id = state_->current.load();
+    if (id != kInvalidTimer) {
+        try_cancel_timer(id);
+    }
+}
+
+bool SleepAwaiter::suspend(std::coroutine_handle<> handle, std::shared_ptr<TimerFlowState> state) {
+    if (state && state->cancelled.load()) {
+        fired_ = false;
+        return false;
+    }
+    // Последний id, который видел сценарий до этого ожидания (см. ниже).
+    TimerId previous = state ? state->current.load() : kInvalidTimer;
+    const std::string label = std::move(label_);
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline_ - Clock::now());
+    if (left <= std::chrono::milliseconds(0)) {
+        fired_ = true;
+        return false;
+    }
+    bool* fired = &fired_;
+    auto frame = std::make_shared<SuspendedFrame>(handle);
+    const TimerId id = add_timer(left, label, [frame, fired](TimerId, TimerOutcome outcome) {
+        *fired = outcome == TimerOutcome::Fired;
+        frame->resume();
+    });
+    if (id == kInvalidTimer) {
+        // Колбэк не заведён и не будет вызван: продолжаем сразу.
+        frame->release();
+        fired_ = false;
+        return false;
+    }
+    frame.reset();
+    // С этого момента корутину может возобновить пул, и кадр (вместе с *this) может
+    // уже не существовать: дальше — только локальные копии. Возобновлённый сценарий
+    // мог успеть дойти до следующего ожидания и записать свой id — его не затираем.
+    if (state && state->current.compare_exchange_strong(previous, id)) {
+        if (state->cancelled.load()) {
+            try_cancel_timer(id);
+        }
+    }
+    return true;
+}
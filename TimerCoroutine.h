@@ -0,0 +1,97 @@
+﻿#pragma once
+
+// Корутины поверх движка таймеров: последовательные сценарии вида
+// «25 минут, потом 5, потом уведомить» без потока на каждый сценарий.
+//
+//     TimerFlow pomodoro() {
+//         if (!co_await sleep_for(std::chrono::minutes(25), "Работа")) co_return;
+//         if (!co_await sleep_for(std::chrono::minutes(5), "Перерыв")) co_return;
+//         notify();
+//     }
+//
+// Каждое ожидание — обычный таймер add_timer: он виден в list, отменяется cancel по id
+// и пишется в журнал (после перезапуска сработает уже без сценария). Пока сценарий
+// ждёт, он стоит только своего кадра корутины и записи таймера.
+// Сценарий начинается сразу в вызвавшем потоке, а после каждого co_await продолжается
+// в пуле исполнителей (--workers), поэтому долгая работа между ожиданиями занимает его поток.
+// Сценарии, ожидающие при shutdown_all, не возобновляются: их кадры уничтожаются вместе
+// с колбэками таймеров (деструкторы локальных переменных сценария выполняются),
+// а TimerFlow::done() становится true.
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <memory>
+#include <string>
+
+#include "TimerEngine.h"
+
+// Общее состояние сценария и его TimerFlow: переживает кадр корутины.
+struct TimerFlowState {
+    std::atomic<TimerId> current{ kInvalidTimer }; // Таймер текущего ожидания.
+    std::atomic<bool> cancelled{ false };
+    std::atomic<bool> done{ false };
+};
+
+// Тип возврата корутины-сценария. Сценарий не привязан к объекту: его можно отбросить,
+// а можно хранить, чтобы отменить или узнать, закончился ли он.
+class TimerFlow {
+public:
+    struct promise_type {
+        std::shared_ptr<TimerFlowState> state = std::make_shared<TimerFlowState>();
+
+        TimerFlow get_return_object() { return TimerFlow(state); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception();
+        // И по завершении, и когда кадр уничтожили на ожидании (shutdown_all).
+        ~promise_type() { state->done.store(true); }
+    };
+
+    TimerFlow() = default;
+
+    // Отменяет текущее ожидание (co_await вернёт false) и все следующие: они
+    // сразу возвращают false, не заводя таймеров.
+    void cancel() const;
+    bool done() const { return !state_ || state_->done.load(); }
+    // Таймер, которого сценарий ждёт сейчас (или ждал последним); kInvalidTimer — ещё ни одного.
+    TimerId current() const { return state_ ? state_->current.load() : kInvalidTimer; }
+
+private:
+    explicit TimerFlow(std::shared_ptr<TimerFlowState> state) : state_(std::move(state)) {}
+
+    std::shared_ptr<TimerFlowState> state_;
+};
+
+// Ожидание срока. co_await возвращает true, когда срок наступил, и false, если ожидание
+// отменено (cancel_timer по id, TimerFlow::cancel) или таймер не удалось завести.
+// Срок уже в прошлом — true без таймера и без приостановки.
+class SleepAwaiter {
+public:
+    SleepAwaiter(Clock::time_point deadline, std::string label)
+        : deadline_(deadline), label_(std::move(label)) {}
+
+    bool await_ready() const noexcept { return false; }
+    // Из TimerFlow ожидание отменяется и через сценарий; из других корутин — только по id.
+    bool await_suspend(std::coroutine_handle<TimerFlow::promise_type> handle) {
+        return suspend(handle, handle.promise().state);
+    }
+    bool await_suspend(std::coroutine_handle<> handle) { return suspend(handle, nullptr); }
+    bool await_resume() const noexcept { return fired_; }
+
+private:
+    bool suspend(std::coroutine_handle<> handle, std::shared_ptr<TimerFlowState> state);
+
+    Clock::time_point deadline_;
+    std::string label_;
+    bool fired_ = false;
+};
+
+// Срок округляется вверх до миллисекунды, как у add_timer.
+inline SleepAwaiter sleep_until(Clock::time_point deadline, std::string label = {}) {
+    return SleepAwaiter(deadline, std::move(label));
+}
+inline SleepAwaiter sleep_for(std::chrono::milliseconds duration, std::string label = {}) {
+    return SleepAwaiter(Clock::now() + duration, std::move(label));
+}
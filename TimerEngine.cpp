@@ -0,0 +1,2425 @@
+﻿#include "TimerEngine.h"
+#include "TimerExecutor.h"
+#include "TimerJournal.h"
+#include "TimerLabels.h"
+#include "TimerPrecision.h"
+#include "TimerQueues.h"
+#include "TimerStats.h"
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#pragma execution_character_set("utf-8")
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Состояние таймера. Переходы — только из Running и только через CAS
+// (try_finish), поэтому таймер не может оказаться одновременно отменённым и сработавшим.
+enum class TimerState : std::uint8_t {
+    Running,
+    Cancelled,
+    Done
+};
+
+// Ожидание потока таймера (EngineKind::Threads). Живёт на стеке самого потока;
+// запись таймера держит на него указатель, пока поток жив (под мьютексом шарда).
+struct TimerWaiter {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false; // Под mutex: пора просыпаться раньше срока.
+};
+
+// Цепочка фаз (add_chain): одна запись таймера проходит фазы по очереди и по
+// срабатыванию фазы перевзводится на месте — без новой записи, потока или id.
+struct TimerChain {
+    std::vector<TimerSpec> phases;              // Не меняются после publish.
+    bool repeat = false;                        // После последней фазы — снова первая, до отмены.
+    std::size_t phase = 0;                      // Текущая фаза. Под мьютексом шарда.
+    // Текущая фаза и её срок для list, который читает без мьютекса: одним словом, чтобы
+    // не увидеть метку одной фазы со сроком другой. Старшие 16 бит — фаза,
+    // младшие 48 — срок в миллисекундах Clock (см. pack_phase).
+    std::atomic<std::uint64_t> shown{ 0 };
+};
+
+constexpr std::size_t kMaxChainPhases = 0xFFFF;
+constexpr std::uint64_t kShownEndMask = (std::uint64_t{ 1 } << 48) - 1;
+
+std::uint64_t pack_phase(std::size_t phase, Clock::time_point end) {
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end.time_since_epoch()).count();
+    return (static_cast<std::uint64_t>(phase) << 48) | (static_cast<std::uint64_t>(ms) & kShownEndMask);
+}
+
+// Слово горячего столбца TimerTable: состояние и срок таймера. Старшие 2 бита — состояние
+// + 1 (0 — в слоте нет записи), младшие 48 — срок в миллисекундах Clock, как в pack_phase.
+// Состояние живёт только здесь: переход из Running — CAS по слову (try_finish), а обходы
+// (list, статистика, снимок журнала) отбирают слоты по слову, не трогая записей.
+constexpr int kHotStateShift = 62;
+
+std::uint64_t pack_hot(TimerState state, Clock::time_point end) {
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end.time_since_epoch()).count();
+    return ((static_cast<std::uint64_t>(state) + 1) << kHotStateShift) | (static_cast<std::uint64_t>(ms) & kShownEndMask);
+}
+
+constexpr TimerState hot_state(std::uint64_t word) {
+    return static_cast<TimerState>((word >> kHotStateShift) - 1);
+}
+
+constexpr bool hot_running(std::uint64_t word) {
+    return (word >> kHotStateShift) == static_cast<std::uint64_t>(TimerState::Running) + 1;
+}
+
+constexpr std::uint64_t hot_end_ms(std::uint64_t word) {
+    return word & kShownEndMask;
+}
+
+// Запись таймера. Состояние и срок для обходов — в горячем столбце таблицы (pack_hot);
+// здесь поля, которые нужны диспетчеру и cancel для одного таймера, — первыми, в одной
+// кэш-линии; метка и служебное — после.
+// Запись не перемещается после вставки в TimerTable, владеет ею таблица.
+struct TimerInfo {
+    Clock::time_point end;                      // Точный срок. Под мьютексом шарда.
+    std::atomic<std::uint64_t>* hot = nullptr;  // Слово записи в горячем столбце; задаёт materialize.
+    TimerId id = kInvalidTimer;                 // Идентификатор таймера.
+
+    PooledLabel label;                          // Имя задачи (у цепочки пусто, метки — в фазах).
+    std::chrono::milliseconds total{ 0 };       // Длительность таймера (у цепочки — текущей фазы).
+    Clock::time_point start;
+    // Цепочка или nullptr. Указатель не меняется после publish; у цепочки end, start
+    // и total под мьютексом шарда меняет перевзвод, поэтому list берёт срок из shown.
+    std::unique_ptr<TimerChain> chain;
+    TimerCallback on_fire;                      // Пусто — только событие [DONE].
+
+    TimerWaiter* waiter = nullptr;              // На чём спит поток таймера (только EngineKind::Threads).
+    std::thread worker;                         // Поток, отсчитывающий данный таймер (только EngineKind::Threads).
+};
+
+// Метка для вывода: у цепочки — метка текущей фазы. Под мьютексом шарда.
+std::string_view current_label(const TimerInfo& t) {
+    return t.chain ? std::string_view(t.chain->phases[t.chain->phase].label) : t.label.view();
+}
+
+TimerState timer_state(const TimerInfo& t) {
+    return hot_state(t.hot->load(std::memory_order_acquire));
+}
+
+// Переводит таймер из Running в to. false — таймер уже отменён или сработал.
+bool try_finish(TimerInfo& t, TimerState to) {
+    std::uint64_t word = t.hot->load(std::memory_order_acquire);
+    while (hot_running(word)) {
+        const std::uint64_t next = hot_end_ms(word) | ((static_cast<std::uint64_t>(to) + 1) << kHotStateShift);
+        if (t.hot->compare_exchange_weak(word, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Очередь FIFO на кольцевом буфере. Растёт удвоением и память не отдаёт, так что
+// в установившемся режиме push_back и pop_front аллокатор не зовут (std::deque
+// выделяет и освобождает блоки по мере продвижения очереди).
+template <class T>
+class RingQueue {
+public:
+    bool empty() const { return size_ == 0; }
+    std::size_t size() const { return size_; }
+    T& front() { return items_[head_]; }
+
+    void push_back(T value) {
+        if (size_ == items_.size()) {
+            grow();
+        }
+        items_[(head_ + size_) & (items_.size() - 1)] = std::move(value);
+        ++size_;
+    }
+
+    void pop_front() {
+        head_ = (head_ + 1) & (items_.size() - 1);
+        --size_;
+    }
+
+private:
+    void grow() {
+        std::vector<T> bigger(items_.empty() ? 16 : items_.size() * 2);
+        for (std::size_t i = 0; i < size_; ++i) {
+            bigger[i] = std::move(items_[(head_ + i) & (items_.size() - 1)]);
+        }
+        items_.swap(bigger);
+        head_ = 0;
+    }
+
+    std::vector<T> items_; // Размер — степень двойки.
+    std::size_t head_ = 0;
+    std::size_t size_ = 0;
+};
+
+// Таблица таймеров — slot map с поколениями.
+// Поиск, вставка и удаление по id за O(1); освобождённые слоты переиспользуются,
+// а увеличенное поколение делает старые id недействительными, а не указывающими на чужой таймер.
+// Слоты лежат блоками фиксированного размера, так что рост таблицы не двигает записи.
+// У каждого шарда своя таблица, и её id несут номер шарда (см. TimerId).
+// reserve() потокобезопасен и не берёт блокировок (это позволяет add_timer выдать id
+// сразу, не дожидаясь планировщика), read_each() — тоже (list не держит планировщик);
+// всё остальное — под мьютексом шарда.
+//
+// Чтобы read_each мог обходить записи без мьютекса, запись публикуется атомарным
+// указателем после заполнения, а удалённая запись разрушается не сразу: по схеме
+// эпох (EBR) слот освобождается, только когда его уже не может видеть ни один читатель.
+//
+// Состояние и срок каждого слота лежат отдельно от записей — в горячем столбце блока
+// (массив слов pack_hot подряд). Обходы сначала отбирают слоты по нему (accept) и
+// трогают запись, только если слово подошло; count() записей не трогает вовсе.
+class TimerTable {
+public:
+    explicit TimerTable(std::size_t shard)
+        : chunks_(std::make_unique<std::atomic<Chunk*>[]>(kMaxChunks)),
+          shard_bits_(static_cast<TimerId>(shard) << kTimerShardShift) {}
+
+    ~TimerTable() {
+        for (std::uint32_t c = 0; c < kMaxChunks; ++c) {
+            delete chunks_[c].load(std::memory_order_relaxed);
+        }
+    }
+
+    TimerTable(const TimerTable&) = delete;
+    TimerTable& operator=(const TimerTable&) = delete;
+
+    // Резервирует слот и возвращает id будущей записи. Без блокировок, из любого потока.
+    // Запись появится в таблице после materialize(id) и publish(id). kInvalidTimer — таблица заполнена.
+    TimerId reserve() {
+        // Стек свободных слотов Трайбера; счётчик в старших битах головы защищает от ABA.
+        std::uint64_t head = free_head_.load(std::memory_order_acquire);
+        while ((head & 0xFFFFFFFFu) != 0) {
+            const auto index = static_cast<std::uint32_t>((head & 0xFFFFFFFFu) - 1);
+            const Slot& s = slot(index);
+            const std::uint64_t next = (((head >> 32) + 1) << 32) | s.next_free.load(std::memory_order_relaxed);
+            if (free_head_.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+                return make_id(index, s.generation);
+            }
+        }
+        const std::uint32_t index = next_fresh_.fetch_add(1, std::memory_order_relaxed);
+        if (index >= kMaxSlots) {
+            return kInvalidTimer;
+        }
+        return make_id(index, base_generation_);
+    }
+
+
+    // Резервирует слот под заданный id (восстановление из журнала). Только пока
+    // не выдан ни один id через reserve(); после всех claim — release_unclaimed().
+    bool claim(TimerId id) {
+        const std::uint64_t low = id & kTimerSlotMask;
+        if (low == 0 || low > kMaxSlots || (id & 0xFFFFFFFFu & ~kTimerSlotMask) != shard_bits_) {
+            return false;
+        }
+        const auto index = static_cast<std::uint32_t>(low - 1);
+        ensure_chunk(index);
+        Slot& s = slot(index);
+        if (s.info) {
+            return false;
+        }
+        s.generation = static_cast<std::uint32_t>(id >> 32);
+        if (index >= next_fresh_.load(std::memory_order_relaxed)) {
+            next_fresh_.store(index + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Отдаёт в стек свободных все слоты ниже последнего занятого claim, которые не заняты.
+    // Незанятые слоты (и все, что появятся потом) начинают с поколения generation —
+    // большего, чем у любого id прошлых запусков (journal_generation): старый id
+    // после перезапуска не указывает на новый таймер.
+    void release_unclaimed(std::uint32_t generation) {
+        base_generation_ = generation;
+        const std::uint32_t fresh = next_fresh_.load(std::memory_order_relaxed);
+        for (std::uint32_t c = 0; c < kMaxChunks; ++c) {
+            if (Chunk* chunk = chunks_[c].load(std::memory_order_relaxed)) {
+                for (Slot& s : chunk->slots) {
+                    if (!s.info) s.generation = generation;
+                }
+            }
+        }
+        for (std::uint32_t i = fresh; i-- > 0;) {
+            ensure_chunk(i);
+            if (!slot(i).info) {
+                push_free(i);
+            }
+        }
+    }
+
+    // Создаёт запись для зарезервированного id и возвращает её для заполнения.
+    // Другим она станет видна после publish(id).
+    TimerInfo& materialize(TimerId id) {
+        const auto index = static_cast<std::uint32_t>((id & kTimerSlotMask) - 1);
+        ensure_chunk(index);
+        Slot& s = slot(index);
+        s.info.emplace();
+        s.info->id = id;
+        s.info->hot = &hot(index);
+        if (index >= bound_.load(std::memory_order_relaxed)) {
+            bound_.store(index + 1, std::memory_order_release);
+        }
+        ++size_;
+        return *s.info;
+    }
+
+    // Делает заполненную запись видимой для find, for_each и read_each: Running со сроком end.
+    void publish(TimerId id) {
+        const auto index = static_cast<std::uint32_t>((id & kTimerSlotMask) - 1);
+        Slot& s = slot(index);
+        hot(index).store(pack_hot(TimerState::Running, s.info->end), std::memory_order_release);
+        s.live.store(&*s.info, std::memory_order_release);
+    }
+
+    // Таймер по id или nullptr, если id неизвестен, ещё не создан или слот уже освобождён.
+    TimerInfo* find(TimerId id) {
+        const std::uint64_t low = id & kTimerSlotMask;
+        if (low == 0 || low > bound_.load(std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        Chunk* chunk = chunks_[(low - 1) / kChunkSize].load(std::memory_order_relaxed);
+        if (!chunk) {
+            return nullptr;
+        }
+        Slot& s = chunk->slots[(low - 1) % kChunkSize];
+        TimerInfo* t = s.live.load(std::memory_order_relaxed);
+        if (!t || s.generation != static_cast<std::uint32_t>(id >> 32)) {
+            return nullptr;
+        }
+        return t;
+    }
+
+    // Удаляет таймер из таблицы. Поток таймера к этому моменту должен быть
+    // уже забран из записи (отдан жнецу), иначе его join блокировал бы вызывающего.
+    // Сама запись разрушается и слот переиспользуется позже, в reclaim().
+    bool erase(TimerId id) {
+        TimerInfo* t = find(id);
+        if (!t) {
+            return false;
+        }
+        if (t->worker.joinable()) {
+            t->worker.join();
+        }
+        const auto index = static_cast<std::uint32_t>((id & kTimerSlotMask) - 1);
+        Slot& s = slot(index);
+        hot(index).store(0, std::memory_order_release);
+        s.live.store(nullptr, std::memory_order_release);
+        ++s.generation;
+        --size_;
+        limbo_.push_back({ index, epoch_.load(std::memory_order_relaxed) });
+        reclaim();
+        return true;
+    }
+
+    // Обход опубликованных записей в порядке номеров слотов (под мьютексом шарда):
+    // f(запись, слово) — для тех, чьё слово горячего столбца приняла accept(слово).
+    template <class Accept, class F>
+    void for_each(Accept&& accept, F&& f) {
+        const std::uint32_t bound = bound_.load(std::memory_order_relaxed);
+        for (std::uint32_t c = 0; c * kChunkSize < bound; ++c) {
+            Chunk* chunk = chunks_[c].load(std::memory_order_relaxed);
+            if (!chunk) {
+                continue;
+            }
+            const std::uint32_t end = std::min(kChunkSize, bound - c * kChunkSize);
+            for (std::uint32_t i = 0; i < end; ++i) {
+                const std::uint64_t word = chunk->hot[i].load(std::memory_order_relaxed);
+                if (word == 0 || !accept(word)) {
+                    continue;
+                }
+                if (TimerInfo* t = chunk->slots[i].live.load(std::memory_order_relaxed)) f(*t, word);
+            }
+        }
+    }
+
+    // То же без мьютекса шарда, из любого потока, параллельно с изменениями таблицы.
+    // f видит только неизменяемые после публикации поля и слово на момент отбора;
+    // записи, удалённые во время обхода, остаются целы до его конца.
+    // f возвращает false, чтобы остановиться; тогда остаток обхода только считается
+    // по горячему столбцу. Возвращает, сколько принятых слотов пришлось на остаток.
+    template <class Accept, class F>
+    std::size_t read_each(Accept&& accept, F&& f) const {
+        ReadPin pin(*this);
+        bool reading = true;
+        std::size_t rest = 0;
+        const std::uint32_t bound = bound_.load(std::memory_order_acquire);
+        for (std::uint32_t c = 0; c * kChunkSize < bound; ++c) {
+            const Chunk* chunk = chunks_[c].load(std::memory_order_acquire);
+            if (!chunk) {
+                continue;
+            }
+            const std::uint32_t end = std::min(kChunkSize, bound - c * kChunkSize);
+            std::uint32_t i = 0;
+            for (; reading && i < end; ++i) {
+                const std::uint64_t word = chunk->hot[i].load(std::memory_order_acquire);
+                if (word == 0 || !accept(word)) {
+                    continue;
+                }
+                const TimerInfo* t = chunk->slots[i].live.load(std::memory_order_acquire);
+                if (t && !f(*t, word)) {
+                    reading = false;
+                    ++rest;
+                }
+            }
+            rest += count_in(*chunk, i, end, accept);
+        }
+        return rest;
+    }
+
+    // Сколько слотов принимает accept — только по горячему столбцу, без мьютекса.
+    template <class Accept>
+    std::size_t count(Accept&& accept) const {
+        std::size_t n = 0;
+        const std::uint32_t bound = bound_.load(std::memory_order_acquire);
+        for (std::uint32_t c = 0; c * kChunkSize < bound; ++c) {
+            if (const Chunk* chunk = chunks_[c].load(std::memory_order_acquire)) {
+                n += count_in(*chunk, 0, std::min(kChunkSize, bound - c * kChunkSize), accept);
+            }
+        }
+        return n;
+    }
+
+    bool empty() const { return size_ == 0; }
+    std::size_t size() const { return size_; }
+
+private:
+    static constexpr std::uint32_t kChunkSize = 1024;
+    static constexpr std::uint32_t kMaxChunks = 16384; // До 16M одновременно живых записей.
+    // Номер слота + 1 должен уместиться в биты слота id.
+    static constexpr std::uint32_t kMaxSlots = static_cast<std::uint32_t>(kTimerSlotMask);
+
+    struct Slot {
+        std::uint32_t generation = 0;
+        std::atomic<std::uint32_t> next_free{ 0 }; // Следующий в стеке свободных (номер + 1).
+        std::atomic<TimerInfo*> live{ nullptr };   // Опубликованная запись; nullptr — её нет или она удалена.
+        std::optional<TimerInfo> info;             // Хранит запись; после erase — до reclaim().
+    };
+
+    // Блок слотов. Горячий столбец — отдельным массивом впереди: обход по нему идёт
+    // подряд по 8 байт на слот, а не шагами в целый Slot с записью внутри.
+    struct Chunk {
+        std::atomic<std::uint64_t> hot[kChunkSize] = {}; // pack_hot; 0 — записи нет.
+        Slot slots[kChunkSize];
+    };
+
+    template <class Accept>
+    static std::size_t count_in(const Chunk& chunk, std::uint32_t from, std::uint32_t to, Accept& accept) {
+        std::size_t n = 0;
+        for (std::uint32_t i = from; i < to; ++i) {
+            const std::uint64_t word = chunk.hot[i].load(std::memory_order_relaxed);
+            n += word != 0 && accept(word);
+        }
+        return n;
+    }
+
+    // Удалённый слот, который ещё могут видеть читатели, начавшие обход до erase.
+    struct LimboSlot {
+        std::uint32_t index;
+        std::uint64_t epoch; // Эпоха, в которой слот удалён.
+    };
+
+    // Участие читателя в эпохе на время обхода.
+    class ReadPin {
+    public:
+        explicit ReadPin(const TimerTable& table) : table_(table) {
+            while (true) {
+                epoch_ = table_.epoch_.load();
+                table_.readers_[epoch_ & 1].fetch_add(1);
+                // Эпоха могла смениться между чтением и отметкой — тогда отметка не считается.
+                if (table_.epoch_.load() == epoch_) {
+                    return;
+                }
+                table_.readers_[epoch_ & 1].fetch_sub(1, std::memory_order_release);
+            }
+        }
+        ~ReadPin() { table_.readers_[epoch_ & 1].fetch_sub(1, std::memory_order_release); }
+
+        ReadPin(const ReadPin&) = delete;
+        ReadPin& operator=(const ReadPin&) = delete;
+
+    private:
+        const TimerTable& table_;
+        std::uint64_t epoch_ = 0;
+    };
+
+    // Эпоха сдвигается с e на e + 1, только когда не осталось читателей из e - 1
+    // (у них та же чётность, что у e + 1). Тогда все текущие читатели начали обход
+    // в e или позже, то есть после удаления слотов эпохи e - 1 и раньше, — их можно освобождать.
+    // Читателей не ждём: не вышло сейчас — освободим при следующем erase.
+    void reclaim() {
+        for (int step = 0; step < 2; ++step) {
+            const std::uint64_t e = epoch_.load(std::memory_order_relaxed);
+            if (readers_[(e + 1) & 1].load() != 0) {
+                break;
+            }
+            epoch_.store(e + 1);
+        }
+        const std::uint64_t e = epoch_.load(std::memory_order_relaxed);
+        while (!limbo_.empty() && limbo_.front().epoch + 2 <= e) {
+            const std::uint32_t index = limbo_.front().index;
+            limbo_.pop_front();
+            slot(index).info.reset();
+            push_free(index);
+        }
+    }
+
+    void push_free(std::uint32_t index) {
+        Slot& s = slot(index);
+        // Поколение записано до публикации слота в стеке (release) — reserve() его увидит.
+        std::uint64_t head = free_head_.load(std::memory_order_relaxed);
+        std::uint64_t next;
+        do {
+            s.next_free.store(static_cast<std::uint32_t>(head & 0xFFFFFFFFu), std::memory_order_relaxed);
+            next = (((head >> 32) + 1) << 32) | (static_cast<std::uint64_t>(index) + 1);
+        } while (!free_head_.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // Блок под слот index; создаётся при первом обращении (под мьютексом шарда).
+    void ensure_chunk(std::uint32_t index) {
+        std::atomic<Chunk*>& chunk = chunks_[index / kChunkSize];
+        if (!chunk.load(std::memory_order_relaxed)) {
+            Chunk* created = new Chunk;
+            for (Slot& s : created->slots) {
+                s.generation = base_generation_;
+            }
+            chunk.store(created, std::memory_order_release);
+        }
+    }
+
+    Slot& slot(std::uint32_t index) {
+        return chunks_[index / kChunkSize].load(std::memory_order_acquire)->slots[index % kChunkSize];
+    }
+
+    const Slot& slot(std::uint32_t index) const {
+        return chunks_[index / kChunkSize].load(std::memory_order_acquire)->slots[index % kChunkSize];
+    }
+
+    std::atomic<std::uint64_t>& hot(std::uint32_t index) {
+        return chunks_[index / kChunkSize].load(std::memory_order_acquire)->hot[index % kChunkSize];
+    }
+
+    TimerId make_id(std::uint32_t index, std::uint32_t generation) const {
+        return (static_cast<TimerId>(generation) << 32) | shard_bits_ | (static_cast<TimerId>(index) + 1);
+    }
+
+    // Каталог блоков фиксированного размера: reserve() и read_each() читают его
+    // без блокировок, поэтому он никогда не перевыделяется.
+    std::unique_ptr<std::atomic<Chunk*>[]> chunks_;
+    std::atomic<std::uint32_t> bound_{ 0 };         // На единицу больше наибольшего созданного номера.
+    std::atomic<std::uint64_t> free_head_{ 0 };     // Вершина стека свободных: (счётчик << 32) | (номер + 1).
+    std::atomic<std::uint32_t> next_fresh_{ 0 };    // Первый ни разу не выданный номер.
+    std::size_t size_ = 0;
+    std::uint32_t base_generation_ = 0;             // Поколение свежих слотов; задаётся до запуска.
+    const TimerId shard_bits_;                      // Номер шарда, сдвинутый на место в id.
+
+    RingQueue<LimboSlot> limbo_;                    // В порядке удаления, то есть по неубыванию эпохи.
+    std::atomic<std::uint64_t> epoch_{ 0 };
+    mutable std::atomic<std::uint32_t> readers_[2] = {}; // Читатели по чётности эпохи.
+};
+
+// Заявка на новый таймер: add_timer кладёт её в Shard::submissions, планировщик создаёт запись.
+struct TimerSubmission {
+    TimerId id = kInvalidTimer;
+    PooledLabel label;
+    std::chrono::milliseconds total{ 0 };
+    Clock::time_point start;
+    Clock::time_point end;
+    std::unique_ptr<TimerChain> chain;          // Только add_chain и восстановление цепочки.
+    TimerCallback on_fire;
+};
+
+// Ограниченная lock-free очередь: много производителей, один потребитель
+// (ограниченная MPMC-очередь Вьюкова с упрощённой стороной чтения).
+// capacity — степень двойки.
+template <class T>
+class MpscRing {
+public:
+    explicit MpscRing(std::size_t capacity)
+        : mask_(capacity - 1), cells_(std::make_unique<Cell[]>(capacity)) {
+        for (std::size_t i = 0; i < capacity; ++i) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // false — очередь заполнена; value при этом не тронут.
+    bool try_push(T&& value) {
+        std::size_t pos = head_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            std::size_t seq = cell->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Кладёт n элементов подряд, так что чужие элементы между ними не окажутся.
+    // fill(i, value) заполняет i-й элемент. false — не хватает места (n <= ёмкости).
+    template <class Fill>
+    bool try_push_n(std::size_t n, Fill&& fill) {
+        std::size_t pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            // Потребитель освобождает ячейки по порядку, поэтому если свободна
+            // последняя из n, свободны и все перед ней.
+            Cell& last = cells_[(pos + n - 1) & mask_];
+            std::size_t seq = last.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + n - 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            Cell& cell = cells_[(pos + i) & mask_];
+            fill(i, cell.value);
+            cell.seq.store(pos + i + 1, std::memory_order_release);
+        }
+        return true;
+    }
+
+    std::size_t capacity() const { return mask_ + 1; }
+
+    // Позиция после последней занятой производителями ячейки (в том числе ещё не дописанной)
+    // и позиция чтения. Ячейки между ними try_pop заберёт, как только их допишут.
+    std::size_t claimed() const { return head_.load(std::memory_order_relaxed); }
+    std::size_t consumed() const { return tail_; }
+
+    // Только потребитель. false — следующая ячейка пуста или занята, но ещё не дописана:
+    // за ней могут стоять уже дописанные. Разобрать всё до claimed() — см. drain_submissions.
+    bool try_pop(T& out) {
+        Cell& cell = cells_[tail_ & mask_];
+        std::size_t seq = cell.seq.load(std::memory_order_acquire);
+        if (static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(tail_ + 1) < 0) {
+            return false;
+        }
+        out = std::move(cell.value);
+        cell.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+        ++tail_;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> seq{ 0 };
+        T value;
+    };
+
+    const std::size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<std::size_t> head_{ 0 };
+    alignas(64) std::size_t tail_ = 0;
+};
+
+// Пробуждение потока, который спит без мьютекса: notify() не блокирует и может
+// звучать из любого потока, лишние вызовы до пробуждения схлопываются в один.
+// В --hires вместо семафора — condition_variable: ожидание семафора со сроком в
+// libstdc++ идёт через общий пул ожидающих, и пока соседние семафоры (писатель лога)
+// заняты, оно просыпается на 15-25 мс позже срока. Цена — короткий мьютекс в notify().
+// В --power-save — IdleTimer: ожидание семафора со сроком libstdc++ ещё и досыпает
+// короткими nanosleep, будя процессор по многу раз в секунду даже при сроке через час.
+class WakeSignal {
+public:
+    // До первого notify() и ожидания: дальше сигнал ждёт на таймере ОС с допуском.
+    void use_idle_timer() {
+        idle_ = std::make_unique<IdleTimer>();
+    }
+
+    void notify() {
+        if (!signaled_.exchange(true, std::memory_order_acq_rel)) {
+            if (idle_) {
+                idle_->notify();
+            }
+            else if (g_hires) {
+                { std::lock_guard<std::mutex> guard(mutex_); }
+                cv_.notify_one();
+            }
+            else {
+                sem_.release();
+            }
+        }
+    }
+
+    // Ждёт notify() не дольше, чем до deadline (max() — без срока). true — был notify().
+    bool wait_until(Clock::time_point deadline) {
+        if (idle_) {
+            const bool woken = idle_->wait_until(deadline, g_power_tolerance);
+            if (woken) {
+                signaled_.store(false, std::memory_order_release);
+            }
+            return woken;
+        }
+        if (g_hires) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            const auto signaled = [this] { return signaled_.load(std::memory_order_acquire); };
+            bool woken = true;
+            if (deadline == Clock::time_point::max()) {
+                cv_.wait(lock, signaled);
+            }
+            else {
+                woken = cv_.wait_until(lock, deadline, signaled);
+            }
+            if (woken) {
+                signaled_.store(false, std::memory_order_release);
+            }
+            return woken;
+        }
+        bool acquired;
+        if (deadline == Clock::time_point::max()) {
+            sem_.acquire();
+            acquired = true;
+        }
+        else {
+            acquired = sem_.try_acquire_until(deadline);
+        }
+        if (acquired) {
+            // Сбрасываем только после acquire: иначе семафор можно было бы отпустить дважды.
+            signaled_.store(false, std::memory_order_release);
+        }
+        return acquired;
+    }
+
+    // Как wait_until, но к deadline просыпается точно (--hires): в wait_until спит
+    // до deadline - kPreciseWindow, остаток — в sleep_until_precise. notify() в этом
+    // остатке сна не прерывает и просто застанет поток при следующем ожидании.
+    void wait_until_precise(Clock::time_point deadline) {
+        if (deadline == Clock::time_point::max()) {
+            wait_until(deadline);
+            return;
+        }
+        if (deadline - Clock::now() > kPreciseWindow && wait_until(deadline - kPreciseWindow)) {
+            return;
+        }
+        sleep_until_precise(deadline);
+    }
+
+private:
+    std::binary_semaphore sem_{ 0 };
+    std::mutex mutex_;           // Только в --hires.
+    std::condition_variable cv_; // Только в --hires.
+    std::unique_ptr<IdleTimer> idle_; // Только в --power-save.
+    std::atomic<bool> signaled_{ false };
+};
+
+using TimingWheel = BasicTimingWheel<Clock::time_point>;
+using TimerHeap = BasicTimerHeap<Clock::time_point>;
+
+// Глобальный флаг работы приложения. Используется для мягкого завершения всех потоков.
+std::atomic<bool> g_running{ true };
+
+// Асинхронный вывод. Все сообщения (ответы REPL и события [ADD]/[DONE]/[CANCEL])
+// идут через одну lock-free очередь в поток-писатель, который склеивает всё
+// накопившееся и сбрасывает поток вывода один раз на пачку.
+enum class LogTarget : std::uint8_t {
+    Console, // Ответы на команды — всегда в консоль.
+    Event    // События таймеров — в консоль или в файл --log.
+};
+
+// Кусок сообщения фиксированного размера прямо в ячейке очереди — без аллокаций.
+// Длинные сообщения занимают несколько ячеек подряд (MpscRing::try_push_n).
+struct LogRecord {
+    static constexpr std::size_t kCapacity = 244;
+
+    LogTarget target = LogTarget::Console;
+    std::uint16_t size = 0;
+    char text[kCapacity];
+};
+
+MpscRing<LogRecord> g_log_ring{ 1 << 14 };
+WakeSignal g_log_wake;
+std::thread g_log_writer;
+std::atomic<bool> g_log_active{ false };       // Писатель запущен; иначе пишем напрямую.
+std::atomic<bool> g_log_stop{ false };
+std::ofstream g_log_file;                      // Открыт — события пишутся в него (--log).
+bool g_log_drop = false;                       // --log-drop: при переполнении события отбрасываются.
+std::atomic<std::uint64_t> g_log_dropped{ 0 }; // Сколько событий отброшено.
+OutputFormat g_output = OutputFormat::Text;    // --pipe: OutputFormat::Pipe.
+EventHook g_event_hook = nullptr;
+thread_local std::string* t_reply_sink = nullptr; // set_reply_sink.
+
+// Завершённые/отменённые таймеры в порядке завершения.
+struct RetiredTimer {
+    TimerId id;
+    Clock::time_point at;
+};
+
+// Шард движка: своя таблица таймеров, колесо, очередь заявок и диспетчер под своим
+// мьютексом. Шарды ничего не делят, кроме вывода, журнала и жнеца, так что добавления
+// в разные шарды не встречаются ни на мьютексе, ни на кэш-линиях. Всё, что не
+// помечено иначе, — под mutex.
+struct Shard {
+    explicit Shard(std::size_t i) : index(i), timers(i) {}
+
+    const std::size_t index;
+    std::mutex mutex;
+
+    // Хранилище таймеров шарда (как активных, так и завершённых/отменённых).
+    TimerTable timers;
+
+    // Колесо таймеров (EngineKind::Wheel) или куча сроков (EngineKind::Heap).
+    TimingWheel wheel{ Clock::now() };
+    TimerHeap heap;
+
+    // Очередь заявок add_timer. Потребитель один в каждый момент —
+    // тот, кто держит mutex (drain_submissions).
+    MpscRing<TimerSubmission> submissions{ 1 << 14 };
+
+    // Поток-диспетчер: разбирает заявки и ведёт колесо. Спит на WakeSignal, а не на cv
+    // под mutex, чтобы add_timer мог разбудить его, не беря мьютекс.
+    std::thread dispatcher;
+    WakeSignal dispatcher_signal;
+
+    // Момент, до которого диспетчер сейчас спит.
+    Clock::time_point dispatcher_wake = Clock::time_point::max();
+
+    RingQueue<RetiredTimer> retired;
+
+    // Записи журнала, сделанные под mutex; в файл их переносит flush_journal уже без него.
+    JournalBatch journal;
+    // Под journal_flush: пачка, которая сейчас пишется. Мьютекс выстраивает пачки шарда
+    // в очередь, чтобы в файле записи шли в порядке событий.
+    std::mutex journal_flush;
+    JournalBatch journal_out;
+
+    // Фоновая чистка по keep_for: спит до истечения срока самой старой записи.
+    std::condition_variable compactor_cv;
+    std::thread compactor;
+};
+
+// Шарды создаёт start_engine(); после этого их число не меняется.
+std::size_t g_shard_count = 1;
+std::size_t g_executor_threads = 0;
+std::vector<std::unique_ptr<Shard>> g_shards;
+
+// Захват мьютекса шарда с замером ожидания для stats.
+std::unique_lock<std::mutex> lock_timers(Shard& shard) {
+    std::unique_lock<std::mutex> lock(shard.mutex, std::try_to_lock);
+    if (lock.owns_lock()) {
+        stats_record(Metric::TimersLockWait, Clock::duration::zero());
+        return lock;
+    }
+    const Clock::time_point start = Clock::now();
+    lock.lock();
+    stats_record(Metric::TimersLockWait, Clock::now() - start);
+    return lock;
+}
+
+// Все шарды разом, по порядку номеров (так два таких захвата не сцепятся):
+// для снимка журнала, который должен видеть все таймеры.
+std::vector<std::unique_lock<std::mutex>> lock_all_shards() {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(g_shards.size());
+    for (auto& shard : g_shards) {
+        locks.push_back(lock_timers(*shard));
+    }
+    return locks;
+}
+
+// Шард, выдавший id, или nullptr, если такого шарда нет.
+Shard* find_shard(TimerId id) {
+    const std::size_t index = shard_of(id);
+    return index < g_shards.size() ? g_shards[index].get() : nullptr;
+}
+
+// «Свой» шард текущего потока: потоки получают шарды по кругу при первом добавлении,
+// так что при числе добавляющих потоков не больше числа шардов они не пересекаются.
+std::atomic<std::size_t> g_next_home_shard{ 0 };
+
+Shard& home_shard() {
+    thread_local const std::size_t index = g_next_home_shard.fetch_add(1, std::memory_order_relaxed);
+    return *g_shards[index % g_shards.size()];
+}
+
+// Прикрепляет поток к ядру core (по модулю числа ядер). Не вышло — поток просто
+// остаётся плавающим: это оптимизация, а не условие работы.
+void pin_to_core(std::thread& thread, std::size_t core) {
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    core %= cores;
+#ifdef _WIN32
+    if (core < sizeof(DWORD_PTR) * 8) { // Ядра одной группы процессоров.
+        SetThreadAffinityMask(thread.native_handle(), DWORD_PTR{ 1 } << core);
+    }
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+}
+
+// Выбранный способ отсчёта (задаётся ключом --engine при запуске).
+EngineKind g_engine = EngineKind::Wheel;
+std::chrono::milliseconds g_slack{ 0 };
+
+// Срок пробуждения с допуском --slack: проснувшись на g_slack позже ближайшего срока,
+// диспетчер одной пачкой забирает и все таймеры со сроками внутри допуска.
+Clock::time_point with_slack(Clock::time_point wake) {
+    return wake == Clock::time_point::max() ? wake : wake + g_slack;
+}
+
+// Когда диспетчеру шарда проснуться ради колеса или кучи. В --hires он продвигает
+// колесо на тик вперёд (см. dispatcher_thread_func), поэтому и просыпается на тик раньше.
+Clock::time_point queue_wake(const Shard& shard) {
+    if (g_engine == EngineKind::Heap) {
+        return with_slack(shard.heap.next_deadline());
+    }
+    const Clock::time_point next = shard.wheel.next_deadline();
+    return with_slack(g_hires && next != Clock::time_point::max() ? next - shard.wheel.tick() : next);
+}
+
+// Ставит срок таймера в колесо или кучу шарда. Под мьютексом шарда.
+void queue_insert(Shard& shard, TimerId id, Clock::time_point end) {
+    if (g_engine == EngineKind::Heap) {
+        shard.heap.insert(id, end);
+    }
+    else {
+        shard.wheel.insert(id, end);
+    }
+}
+
+// Жнец (EngineKind::Threads): join завершившихся потоков таймеров вне мьютексов шардов.
+std::mutex g_reaper_mutex;
+std::condition_variable g_reaper_cv;
+std::vector<std::thread> g_reaper_queue; // Под g_reaper_mutex.
+bool g_reaper_stop = false;              // Под g_reaper_mutex.
+std::thread g_reaper;
+
+RetentionPolicy g_retention;
+
+std::string g_journal_path;
+
+bool g_hires = false;
+
+bool g_power_save = false;
+std::chrono::milliseconds g_power_tolerance{ 50 };
+
+FireHook g_fire_hook = nullptr;
+
+// Периодический вывод статистики (--stats-every, команда stats <секунды>).
+std::chrono::seconds g_stats_every{ 0 };  // Под g_stats_mutex после start_engine(); 0 — выключен.
+std::mutex g_stats_mutex;
+std::condition_variable g_stats_cv;
+std::thread g_stats_thread;               // Запускается при первом ненулевом интервале.
+
+// Ставит сообщение в очередь писателя, нарезав его на LogRecord подряд идущими
+// ячейками. Если очередь полна, события при --log-drop отбрасываются,
+// остальное ждёт места, подгоняя писателя.
+void enqueue_log(LogTarget target, std::string_view msg) {
+    if (!g_log_active.load(std::memory_order_acquire)) {
+        // До запуска и после остановки писателя работает только главный поток.
+        std::cout << msg << std::flush;
+        return;
+    }
+    const Clock::time_point start = Clock::now();
+    // Сообщение больше половины очереди идёт несколькими порциями.
+    const std::size_t max_records = g_log_ring.capacity() / 2;
+    while (!msg.empty()) {
+        std::size_t records = (msg.size() + LogRecord::kCapacity - 1) / LogRecord::kCapacity;
+        if (records > max_records) records = max_records;
+        const std::string_view part = msg.substr(0, records * LogRecord::kCapacity);
+        auto fill = [&](std::size_t i, LogRecord& rec) {
+            const std::string_view piece = part.substr(i * LogRecord::kCapacity, LogRecord::kCapacity);
+            rec.target = target;
+            rec.size = static_cast<std::uint16_t>(piece.size());
+            std::memcpy(rec.text, piece.data(), piece.size());
+        };
+        while (!g_log_ring.try_push_n(records, fill)) {
+            if (target == LogTarget::Event && g_log_drop) {
+                g_log_dropped.fetch_add(1, std::memory_order_relaxed);
+                stats_record(Metric::LogWait, Clock::now() - start);
+                return;
+            }
+            g_log_wake.notify();
+            std::this_thread::yield();
+        }
+        msg.remove_prefix(part.size());
+    }
+    g_log_wake.notify();
+    stats_record(Metric::LogWait, Clock::now() - start);
+}
+
+// Вывод в консоль. 
+void safe_print(std::string_view msg) {
+    if (t_reply_sink) {
+        t_reply_sink->append(msg);
+        return;
+    }
+    enqueue_log(LogTarget::Console, msg);
+}
+
+// Событие таймера ([ADD]/[DONE]/[CANCEL]).
+void log_event(std::string_view msg) {
+    if (t_reply_sink) {
+        t_reply_sink->append(msg);
+    }
+    else if (g_event_hook) {
+        g_event_hook(msg);
+    }
+    enqueue_log(LogTarget::Event, msg);
+}
+
+void set_reply_sink(std::string* sink) {
+    t_reply_sink = sink;
+}
+
+// Поток-писатель: забирает всё накопившееся, пишет одним куском и сбрасывает
+// каждый поток вывода один раз на пачку.
+void log_writer_func() {
+    std::string console;
+    std::string events;
+    LogRecord rec;
+    while (true) {
+        // Флаг читаем до разбора: всё, что поставлено до stop_log, будет записано.
+        bool stop = g_log_stop.load(std::memory_order_acquire);
+        while (g_log_ring.try_pop(rec)) {
+            if (rec.target == LogTarget::Event && g_log_file.is_open()) {
+                events.append(rec.text, rec.size);
+            }
+            else {
+                console.append(rec.text, rec.size);
+            }
+        }
+        if (!console.empty()) {
+            std::cout << console << std::flush;
+            console.clear();
+        }
+        if (!events.empty()) {
+            g_log_file << events << std::flush;
+            events.clear();
+        }
+        if (stop) {
+            return;
+        }
+        g_log_wake.wait_until(Clock::time_point::max());
+    }
+}
+
+void start_log() {
+    g_log_writer = std::thread(log_writer_func);
+    g_log_active.store(true, std::memory_order_release);
+}
+
+// Дописывает всё из очереди и останавливает писателя. Вызывается последним.
+void stop_log() {
+    if (!g_log_writer.joinable()) {
+        return;
+    }
+    g_log_active.store(false, std::memory_order_release);
+    g_log_stop.store(true, std::memory_order_release);
+    g_log_wake.notify();
+    g_log_writer.join();
+}
+
+// Форматирование без ostringstream и локалей: всё дописывается в переданную строку,
+// чью ёмкость вызывающий переиспользует (см. message_buffer).
+
+void append_uint(std::string& out, std::uint64_t value) {
+    char buf[20];
+    auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, ptr);
+}
+
+// Корректный вид для чтения: 25m, 1m30s, 4s250ms, 750ms. Миллисекунды — только
+// у таймеров короче минуты, у длинных они лишь зашумили бы вывод.
+void append_duration(std::string& out, std::chrono::milliseconds d) {
+    auto total = d.count();
+    if (total < 0) total = 0;
+    auto m = static_cast<std::uint64_t>(total / 60000);
+    auto sec = static_cast<std::uint64_t>(total / 1000 % 60);
+    auto ms = static_cast<std::uint64_t>(total % 1000);
+    if (m > 0) {
+        append_uint(out, m);
+        out += 'm';
+        if (sec > 0) {
+            append_uint(out, sec);
+            out += 's';
+        }
+    }
+    else if (ms == 0 || sec > 0) {
+        append_uint(out, sec);
+        out += 's';
+    }
+    if (m == 0 && ms > 0) {
+        append_uint(out, ms);
+        out += "ms";
+    }
+}
+
+// Поле строки Pipe: табуляция внутри метки заменяется пробелом, чтобы не сдвинуть поля.
+void append_field(std::string& out, std::string_view text) {
+    out += '\t';
+    const std::size_t from = out.size();
+    out += text;
+    std::replace(out.begin() + static_cast<std::ptrdiff_t>(from), out.end(), '\t', ' ');
+}
+
+enum class EventKind { Add, Done, Cancel, Next };
+
+// Строка события с переводом строки: "[ADD]  #<id> "<label>" на <duration>",
+// в Pipe — "ADD\t<id>\t<мс>\t<label>". NEXT (цепочка перешла к следующей фазе)
+// тоже с длительностью, DONE и CANCEL — без неё.
+void append_event(std::string& out, EventKind kind, TimerId id, std::string_view label,
+    std::chrono::milliseconds duration = std::chrono::milliseconds(0)) {
+    if (g_output == OutputFormat::Pipe) {
+        static const char* const names[] = { "ADD", "DONE", "CANCEL", "NEXT" };
+        out += names[static_cast<int>(kind)];
+        out += '\t';
+        append_uint(out, id);
+        if (kind == EventKind::Add || kind == EventKind::Next) {
+            out += '\t';
+            append_uint(out, static_cast<std::uint64_t>(duration.count()));
+        }
+        append_field(out, label);
+        out += '\n';
+        return;
+    }
+    static const char* const tags[] = { "[ADD]  ", "[DONE]  ", "[CANCEL] ", "[NEXT]  " };
+    out += tags[static_cast<int>(kind)];
+    out += '#';
+    append_uint(out, id);
+    out += " \"";
+    out += label;
+    out += '"';
+    if (kind == EventKind::Add || kind == EventKind::Next) {
+        out += " на ";
+        append_duration(out, duration);
+    }
+    out += '\n';
+}
+
+// Ошибка команды: в Text печатает text, в Pipe — "ERR\t<code>[\t<detail>]".
+void print_error(std::string_view code, std::string_view text, std::string_view detail) {
+    if (g_output == OutputFormat::Text) {
+        safe_print(text);
+        return;
+    }
+    std::string msg = "ERR\t";
+    msg += code;
+    if (!detail.empty()) {
+        append_field(msg, detail);
+    }
+    msg += '\n';
+    safe_print(msg);
+}
+
+// Пустой буфер для сборки сообщения текущим потоком. После первых сообщений
+// его ёмкости хватает, и форматирование больше не обращается к аллокатору.
+std::string& message_buffer() {
+    thread_local std::string buffer;
+    buffer.clear();
+    return buffer;
+}
+
+// Будит поток таймера после отмены или сброса g_running. Под мьютексом шарда:
+// пока указатель waiter не обнулён, поток жив и ждёт на нём.
+void wake_timer(TimerInfo& t) {
+    if (!t.waiter) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(t.waiter->mutex);
+        t.waiter->stop = true;
+    }
+    t.waiter->cv.notify_one();
+}
+
+// Передаёт поток жнецу: join выполнится в его потоке, без удержания чужих мьютексов.
+void reap_later(std::thread&& worker) {
+    {
+        std::lock_guard<std::mutex> lock(g_reaper_mutex);
+        g_reaper_queue.push_back(std::move(worker));
+    }
+    g_reaper_cv.notify_one();
+}
+
+// Поток-жнец: дожидается завершения отданных ему потоков.
+// При остановке сначала дочищает очередь, затем выходит.
+void reaper_thread_func() {
+    std::vector<std::thread> batch;
+    std::unique_lock<std::mutex> lock(g_reaper_mutex);
+    while (true) {
+        g_reaper_cv.wait(lock, [] { return g_reaper_stop || !g_reaper_queue.empty(); });
+        if (g_reaper_queue.empty()) {
+            return;
+        }
+        batch.swap(g_reaper_queue);
+        lock.unlock();
+        for (auto& worker : batch) {
+            worker.join();
+        }
+        batch.clear();
+        lock.lock();
+    }
+}
+
+// Удаляет из таблицы шарда записи, вышедшие за g_retention (keep_last — на шард).
+// Каждая запись удаляется ровно один раз, так что амортизированно O(1) на таймер.
+void compact_retired(Shard& shard, Clock::time_point now) {
+    while (!shard.retired.empty()) {
+        const RetiredTimer& oldest = shard.retired.front();
+        bool over_count = shard.retired.size() > g_retention.keep_last;
+        bool over_age = g_retention.keep_for > std::chrono::seconds(0) &&
+            now - oldest.at >= g_retention.keep_for;
+        if (!over_count && !over_age) {
+            break;
+        }
+        if (TimerInfo* t = shard.timers.find(oldest.id)) {
+            if (t->worker.joinable()) {
+                reap_later(std::move(t->worker));
+            }
+            shard.timers.erase(oldest.id);
+        }
+        shard.retired.pop_front();
+    }
+}
+
+// Отмечает, что таймер завершился или отменён, и сразу применяет ограничения хранения.
+// Под мьютексом шарда.
+void note_retired(Shard& shard, TimerId id) {
+    auto now = Clock::now();
+    bool was_empty = shard.retired.empty();
+    shard.retired.push_back(RetiredTimer{ id, now });
+    compact_retired(shard, now);
+    if (was_empty && !shard.retired.empty()) {
+        // У фоновой чистки появился срок, до которого спать.
+        shard.compactor_cv.notify_one();
+    }
+}
+
+// Поток фоновой чистки шарда (только при заданном keep_for): без него записи
+// простаивающего процесса жили бы до следующей команды.
+void compactor_thread_func(Shard& shard) {
+    auto lock = lock_timers(shard);
+    while (g_running.load(std::memory_order_relaxed)) {
+        compact_retired(shard, Clock::now());
+        if (shard.retired.empty()) {
+            shard.compactor_cv.wait(lock);
+        }
+        else {
+            shard.compactor_cv.wait_until(lock, shard.retired.front().at + g_retention.keep_for);
+        }
+    }
+}
+
+// Колбэки пачки срабатываний (или отмены). Пулу их отдают после вывода строк [DONE]
+// этой пачки, чтобы вывод колбэка не обгонял сообщение о срабатывании.
+using PendingCallbacks = std::vector<std::function<void()>>;
+
+// Готовит задачу пула для колбэка сработавшего или отменённого таймера.
+void queue_callback(PendingCallbacks& callbacks, TimerId id, TimerOutcome outcome, TimerCallback callback) {
+    const Clock::time_point queued = Clock::now();
+    callbacks.emplace_back([id, outcome, queued, callback = std::move(callback)] {
+        stats_record(Metric::CallbackWait, Clock::now() - queued);
+        try {
+            callback(id, outcome);
+        }
+        catch (...) {
+            // Исключение колбэка не должно уронить поток пула.
+            print_error("callback_failed", "Колбэк таймера #" + std::to_string(id) + " завершился исключением.\n",
+                std::to_string(id));
+        }
+    });
+}
+
+// Отдаёт колбэки пулу исполнителей, в очередь «своего» для шарда потока. Вне мьютекса шарда.
+// Пачка без колбэков — обычный случай для срабатываний: пул не трогаем.
+void submit_callbacks(const Shard& shard, PendingCallbacks& callbacks) {
+    if (!callbacks.empty()) {
+        executor_submit_batch(shard.index, callbacks);
+    }
+}
+
+enum class FireResult {
+    Skipped,  // Таймер уже отменён или сработал.
+    Finished, // Сработал и завершён.
+    Rearmed   // Фаза цепочки сработала, таймер перевзведён: новый срок уже в t.end.
+};
+
+// Срабатывание таймера в момент now: статистика, хук, строки событий в messages,
+// колбэк в callbacks, журнал.
+// Цепочка переходит к следующей фазе в той же записи и остаётся Running. Под мьютексом шарда.
+FireResult fire_timer(Shard& shard, TimerInfo& t, Clock::time_point now, std::string& messages,
+    PendingCallbacks& callbacks) {
+    TimerChain* chain = t.chain.get();
+    const bool rearm = chain && (chain->repeat || chain->phase + 1 < chain->phases.size());
+    if (rearm) {
+        // Состояние меняет только try_finish под тем же мьютексом, так что гонки с cancel нет.
+        if (timer_state(t) != TimerState::Running) {
+            return FireResult::Skipped;
+        }
+    }
+    else if (!try_finish(t, TimerState::Done)) {
+        return FireResult::Skipped;
+    }
+    stats_count(Counter::Fired);
+    stats_record(Metric::FireLateness, now - t.end);
+    if (g_fire_hook) {
+        g_fire_hook(t.id, t.end, now);
+    }
+    append_event(messages, EventKind::Done, t.id, current_label(t));
+    if (t.on_fire) {
+        // Завершённому таймеру колбэк больше не нужен — отдаём его, не копируя.
+        queue_callback(callbacks, t.id, TimerOutcome::Fired, rearm ? t.on_fire : std::move(t.on_fire));
+    }
+    if (!rearm) {
+        journal_done(shard.journal, t.id);
+        note_retired(shard, t.id);
+        return FireResult::Finished;
+    }
+
+    stats_count(Counter::Rearmed);
+    chain->phase = (chain->phase + 1) % chain->phases.size();
+    const TimerSpec& next = chain->phases[chain->phase];
+    // Следующая фаза отсчитывается от срока предыдущей, а не от момента обработки,
+    // чтобы повторы не копили опоздание. Если отстали больше чем на фазу (простой
+    // после восстановления из журнала), пропущенное не догоняем — считаем от now.
+    t.start = t.end + next.duration > now ? t.end : now;
+    t.end = t.start + next.duration;
+    t.total = next.duration;
+    // Слово меняют только под мьютексом шарда, так что Running в нём никто не сменит.
+    t.hot->store(pack_hot(TimerState::Running, t.end), std::memory_order_release);
+    chain->shown.store(pack_phase(chain->phase, t.end), std::memory_order_release);
+    append_event(messages, EventKind::Next, t.id, next.label, next.duration);
+    journal_add_chain(shard.journal, t.id, t.end, chain->phases, chain->phase, chain->repeat);
+    return FireResult::Rearmed;
+}
+
+// Переносит записи журнала шарда в файл. Без мьютекса шарда: его берём, только чтобы
+// забрать пачку, а мьютекс журнала — уже после, так что шарды не ждут друг друга.
+void flush_journal(Shard& shard) {
+    if (g_journal_path.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> flush(shard.journal_flush);
+    {
+        auto lock = lock_timers(shard);
+        if (shard.journal.empty()) {
+            return;
+        }
+        std::swap(shard.journal, shard.journal_out);
+        shard.journal_out.epoch = journal_epoch();
+    }
+    journal_write(shard.journal_out);
+}
+
+// Функция, выполняющаяся в отдельном потоке для конкретного таймера.
+// Спит до end, реагирует на отмену и глобальное завершение без опроса.
+// Цепочку ведёт тот же поток: после перевзвода просто ждёт следующего срока.
+// К записи таймера обращается только под мьютексом шарда и по id: запись могут
+// отменить и вычистить, пока поток спит, — тогда find просто не найдёт её.
+void timer_thread_func(Shard& shard, TimerId id, Clock::time_point end) {
+    TimerWaiter waiter;
+    {
+        auto lock = lock_timers(shard);
+        TimerInfo* t = shard.timers.find(id);
+        if (!t) {
+            return;
+        }
+        if (!g_running.load(std::memory_order_relaxed) ||
+            timer_state(*t) != TimerState::Running) {
+            // Отменён раньше, чем поток успел начать ждать.
+            if (t->worker.joinable()) {
+                reap_later(std::move(t->worker));
+            }
+            return;
+        }
+        t->waiter = &waiter;
+    }
+
+    while (true) {
+        {
+            // Одно ожидание до самого срока: ни периодических пробуждений,
+            // ни задержки реакции на отмену/выход.
+            std::unique_lock<std::mutex> lock(waiter.mutex);
+            if (!g_hires) {
+                waiter.cv.wait_until(lock, end, [&] { return waiter.stop; });
+            }
+            else if (!waiter.cv.wait_until(lock, end - kPreciseWindow, [&] { return waiter.stop; })) {
+                // --hires: последний отрезок — на высокоточном таймере; отмена в нём
+                // заметится сразу после него.
+                lock.unlock();
+                sleep_until_precise(end);
+            }
+        }
+
+        std::string& msg = message_buffer();
+        PendingCallbacks callbacks;
+        FireResult result = FireResult::Skipped;
+        {
+            auto lock = lock_timers(shard);
+            TimerInfo* t = shard.timers.find(id);
+            if (!t) {
+                // Запись уже вычищена; свой std::thread отдала жнецу compact_retired.
+                return;
+            }
+            // Если приложение останавливается или таймер отменён — выходим тихо.
+            if (g_running.load(std::memory_order_relaxed)) {
+                result = fire_timer(shard, *t, Clock::now(), msg, callbacks);
+            }
+            if (result == FireResult::Rearmed) {
+                end = t->end;
+            }
+            else {
+                t->waiter = nullptr;
+                // Забираем свой std::thread из таблицы и отдаём жнецу.
+                // Если поток уже забрал shutdown_all, ничего не делаем.
+                if (t->worker.joinable()) {
+                    reap_later(std::move(t->worker));
+                }
+            }
+        }
+
+        flush_journal(shard);
+        // Сообщаем о срабатывании.
+        if (!msg.empty()) {
+            log_event(msg);
+        }
+        submit_callbacks(shard, callbacks);
+        if (result != FireResult::Rearmed) {
+            return;
+        }
+    }
+}
+
+// Будит диспетчер шарда. Без блокировок; можно звать из любого потока.
+void wake_dispatcher(Shard& shard) {
+    shard.dispatcher_signal.notify();
+}
+
+// Создаёт запись по заявке и привязывает к ней поток или слот колеса. Под мьютексом шарда.
+void materialize_submission(Shard& shard, TimerSubmission& sub) {
+    TimerInfo& t = shard.timers.materialize(sub.id);
+    t.label = std::move(sub.label);
+    t.total = sub.total;
+    t.start = sub.start;
+    t.end = sub.end;
+    t.chain = std::move(sub.chain);
+    t.on_fire = std::move(sub.on_fire);
+    if (t.chain) {
+        t.chain->shown.store(pack_phase(t.chain->phase, t.end), std::memory_order_relaxed);
+    }
+    if (g_engine == EngineKind::Threads) {
+        // Во время остановки потоки уже не запускаем: запись просто останется Running.
+        if (g_running.load(std::memory_order_relaxed)) {
+            t.worker = std::thread(timer_thread_func, std::ref(shard), t.id, t.end);
+        }
+    }
+    else {
+        queue_insert(shard, t.id, t.end);
+    }
+    shard.timers.publish(t.id);
+    if (t.chain) {
+        journal_add_chain(shard.journal, t.id, t.end, t.chain->phases, t.chain->phase, t.chain->repeat);
+    }
+    else {
+        journal_add(shard.journal, t.id, t.end, t.total, t.label);
+    }
+}
+
+// Переносит все поступившие заявки шарда в его таблицу. Под мьютексом шарда (lock);
+// вызывается перед любой работой с таблицей, так что cancel/list видят каждый уже
+// вернувшийся add.
+void drain_submissions(Shard& shard, std::unique_lock<std::mutex>& lock) {
+    TimerSubmission sub;
+    bool any = false;
+    // Разбираем всё, что занято к этому моменту: если более ранний производитель
+    // ещё дописывает свою ячейку, ждём его, иначе застрявшая за ней заявка уже
+    // вернувшегося add не попала бы в таблицу. Ждём, отпустив мьютекс, чтобы
+    // вытесненный производитель не держал весь шард; разобрать за это время
+    // может и другой поток — тогда consumed() уйдёт за until.
+    const std::size_t until = shard.submissions.claimed();
+    while (static_cast<std::ptrdiff_t>(until - shard.submissions.consumed()) > 0) {
+        if (shard.submissions.try_pop(sub)) {
+            materialize_submission(shard, sub);
+            any = true;
+        }
+        else {
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+        }
+    }
+    // Разобрали не в диспетчере — будим его, если новый таймер раньше его пробуждения
+    // или записи журнала ждут переноса в файл (их переносит диспетчер, отпустив мьютекс).
+    // Бодрствующий диспетчер (dispatcher_wake == min) перенесёт их сам перед сном.
+    if (any && shard.dispatcher_wake != Clock::time_point::min() && (!shard.journal.empty() ||
+        (g_engine != EngineKind::Threads && queue_wake(shard) < shard.dispatcher_wake))) {
+        wake_dispatcher(shard);
+    }
+}
+
+// Записывает снимок ожидающих таймеров всех шардов и заменяет им журнал. Под мьютексами
+// всех шардов (lock_all_shards): иначе запись другого шарда ушла бы в заменяемый файл.
+// Ещё не перенесённые пачки шардов снимок уже учёл, после него они не нужны.
+// Стоит O(числа таймеров), но вызывается, только когда журнал после снимка перерос
+// сам снимок, так что в пересчёте на запись остаётся O(1).
+void compact_journal() {
+    if (!journal_begin_snapshot(g_journal_path)) {
+        return;
+    }
+    for (auto& shard : g_shards) {
+        shard->timers.for_each(hot_running, [](const TimerInfo& t, std::uint64_t) {
+            if (t.chain) {
+                journal_snapshot_add_chain(t.id, t.end, t.chain->phases, t.chain->phase, t.chain->repeat);
+            }
+            else {
+                journal_snapshot_add(t.id, t.end, t.total, t.label);
+            }
+        });
+    }
+    if (journal_commit_snapshot()) {
+        for (auto& shard : g_shards) {
+            journal_discard(shard->journal);
+        }
+    }
+}
+
+// Восстанавливает ожидающие таймеры из журнала с прежними id и сроками и открывает
+// журнал для дописывания (повреждённый — заменяет снимком). Вызывается из start_engine
+// до запуска потоков.
+void restore_journal() {
+    const Clock::time_point start = Clock::now();
+    std::size_t restored = 0;
+    bool intact = true;
+    {
+        auto locks = lock_all_shards();
+        // Таймеры шардов, которых в этом запуске нет (--shards стало меньше): id несёт
+        // номер шарда, так что прежний id им не сохранить — получат новые после всех claim.
+        std::vector<TimerSubmission> homeless;
+        intact = journal_recover(g_journal_path, [&](RecoveredTimer& r) {
+            TimerSubmission sub;
+            sub.id = r.id;
+            sub.total = r.total;
+            sub.end = r.end;
+            sub.start = r.end - r.total;
+            if (r.phases.empty()) {
+                sub.label = PooledLabel(r.label);
+            }
+            else {
+                sub.chain = std::make_unique<TimerChain>();
+                sub.chain->phases = std::move(r.phases);
+                sub.chain->phase = r.phase;
+                sub.chain->repeat = r.repeat;
+            }
+            Shard* shard = find_shard(r.id);
+            if (!shard) {
+                homeless.push_back(std::move(sub));
+                return;
+            }
+            if (!shard->timers.claim(r.id)) {
+                return;
+            }
+            materialize_submission(*shard, sub);
+            ++restored;
+        });
+        for (auto& shard : g_shards) {
+            shard->timers.release_unclaimed(journal_generation());
+        }
+        for (std::size_t i = 0; i < homeless.size(); ++i) {
+            Shard& shard = *g_shards[i % g_shards.size()];
+            homeless[i].id = shard.timers.reserve();
+            if (homeless[i].id != kInvalidTimer) {
+                materialize_submission(shard, homeless[i]);
+                ++restored;
+            }
+        }
+        // Восстановленные считаются добавленными: их срабатывания и отмены stats тоже считает.
+        stats_count(Counter::Added, restored);
+        if (!intact || !homeless.empty() || !journal_open(g_journal_path)) {
+            // Новые id перешли в журнал записями add, а старые остались бы в нём
+            // ожидающими — снимок убирает их.
+            compact_journal();
+        }
+    }
+
+    if (!intact) {
+        print_error("journal_damaged", "Журнал повреждён: восстановлено то, что удалось прочитать.\n");
+    }
+    if (!journal_is_open()) {
+        print_error("journal_unavailable", "Не удалось открыть журнал: " + g_journal_path + "\n", g_journal_path);
+    }
+    if (restored > 0) {
+        const bool pipe = g_output == OutputFormat::Pipe;
+        std::string& msg = message_buffer();
+        msg += pipe ? "RESTORED\t" : "Восстановлено таймеров из журнала: ";
+        append_uint(msg, restored);
+        msg += pipe ? "\t" : " (";
+        append_uint(msg, static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count()));
+        msg += pipe ? "\n" : " мс)\n";
+        safe_print(msg);
+    }
+}
+
+// Поток-диспетчер шарда. Разбирает заявки add_timer (в EngineKind::Threads — только это)
+// и ведёт колесо или кучу: спит до ближайшего их события, просыпается раньше,
+// если пришли заявки или приложение завершается.
+void dispatcher_thread_func(Shard& shard) {
+    std::vector<TimerId> fired;
+    // --hires: таймеры, которые колесо отдало за тик до срока, ждут его здесь.
+    // Куча по сроку (ближайший — в front).
+    std::vector<std::pair<Clock::time_point, TimerId>> imminent;
+    const auto later = std::greater<>();
+    std::string messages; // Строки [DONE] одной пачки; ёмкость переиспользуется.
+    PendingCallbacks callbacks;
+
+    auto fire = [&](TimerInfo& t, Clock::time_point now) {
+        if (fire_timer(shard, t, now, messages, callbacks) == FireResult::Rearmed) {
+            queue_insert(shard, t.id, t.end);
+        }
+    };
+
+    auto lock = lock_timers(shard);
+    while (g_running.load(std::memory_order_relaxed)) {
+        shard.dispatcher_wake = Clock::time_point::min(); // Не спим: своё пробуждение не нужно.
+        drain_submissions(shard, lock);
+        const Clock::time_point now = Clock::now();
+        // Колесо округляет сроки вверх до тика. В --hires оно продвигается на тик вперёд,
+        // и таймеры со сроком внутри этого тика досыпают до точного срока через imminent.
+        // Куча отдаёт таймеры точно по сроку.
+        if (g_engine == EngineKind::Heap) {
+            shard.heap.advance(now, fired);
+        }
+        else {
+            shard.wheel.advance(g_hires ? now + shard.wheel.tick() : now, fired);
+        }
+
+        for (TimerId id : fired) {
+            TimerInfo* t = shard.timers.find(id);
+            // Отменённые таймеры остаются в колесе (куче) до своего срока и здесь просто отбрасываются.
+            if (!t) {
+                continue;
+            }
+            if (t->end > now) {
+                imminent.emplace_back(t->end, id);
+                std::push_heap(imminent.begin(), imminent.end(), later);
+                continue;
+            }
+            fire(*t, now);
+        }
+        fired.clear();
+        while (!imminent.empty() && imminent.front().first <= now) {
+            const TimerId id = imminent.front().second;
+            std::pop_heap(imminent.begin(), imminent.end(), later);
+            imminent.pop_back();
+            if (TimerInfo* t = shard.timers.find(id)) {
+                fire(*t, now);
+            }
+        }
+
+        if (!messages.empty()) {
+            stats_count(Counter::Batches);
+            // Печатаем вне мьютекса шарда, чтобы не держать add/cancel/list на выводе.
+            lock.unlock();
+            flush_journal(shard);
+            log_event(messages);
+            messages.clear();
+            submit_callbacks(shard, callbacks);
+            lock.lock();
+            continue;
+        }
+
+        if (journal_needs_compaction()) {
+            // Снимку нужны все шарды, а берут их только по порядку номеров.
+            lock.unlock();
+            {
+                auto locks = lock_all_shards();
+                // Пока ждали, журнал мог свернуть диспетчер другого шарда.
+                if (journal_needs_compaction()) {
+                    compact_journal();
+                }
+            }
+            lock.lock();
+            continue;
+        }
+
+        shard.dispatcher_wake = queue_wake(shard);
+        if (!imminent.empty() && with_slack(imminent.front().first) < shard.dispatcher_wake) {
+            shard.dispatcher_wake = with_slack(imminent.front().first);
+        }
+        const Clock::time_point wake = shard.dispatcher_wake;
+        lock.unlock();
+        flush_journal(shard);
+        if (g_hires) {
+            shard.dispatcher_signal.wait_until_precise(wake);
+        }
+        else {
+            shard.dispatcher_signal.wait_until(wake);
+        }
+        stats_count(Counter::Wakeups);
+        lock.lock();
+    }
+}
+
+// Задержка в наносекундах с единицей измерения: 850ns, 12.3us, 4.5ms, 1.2s.
+void append_latency(std::string& out, std::uint64_t ns) {
+    if (ns < 1000) {
+        append_uint(out, ns);
+        out += "ns";
+        return;
+    }
+    std::uint64_t unit = 1000;
+    const char* suffix = "us";
+    if (ns >= 1000000000) {
+        unit = 1000000000;
+        suffix = "s";
+    }
+    else if (ns >= 1000000) {
+        unit = 1000000;
+        suffix = "ms";
+    }
+    const std::uint64_t tenths = ns / (unit / 10);
+    append_uint(out, tenths / 10);
+    out += '.';
+    append_uint(out, tenths % 10);
+    out += suffix;
+}
+
+// Дописывает text и дополняет пробелами до width символов (UTF-8, а не байтов).
+void append_padded(std::string& out, std::string_view text, std::size_t width, bool right = false) {
+    std::size_t chars = 0;
+    for (char c : text) {
+        if ((static_cast<unsigned char>(c) & 0xC0) != 0x80) ++chars;
+    }
+    const std::size_t pad = chars < width ? width - chars : 0;
+    if (!right) out += text;
+    out.append(pad, ' ');
+    if (right) out += text;
+}
+
+// Отчёт статистики для Pipe: "COUNT\t<имя>\t<значение>" на счётчик,
+// "LATENCY\t<имя>\t<всего>\t<p50>\t<p90>\t<p99>\t<p99.9>\t<max>" (в наносекундах)
+// на гистограмму и "END\tstats" в конце.
+// Просроченные таймеры: Running со сроком в прошлом (в list — PENDING), то есть
+// сработавшие, но ещё никем не обработанные. Без мьютексов, по горячим столбцам таблиц.
+std::uint64_t overdue_count() {
+    const auto now = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count()) & kShownEndMask;
+    const auto overdue = [now](std::uint64_t word) { return hot_running(word) && hot_end_ms(word) < now; };
+    std::uint64_t count = 0;
+    for (const auto& shard : g_shards) {
+        count += shard->timers.count(overdue);
+    }
+    return count;
+}
+
+// Ждущие таймеры: Running по горячим столбцам, после разбора заявок, чтобы учесть
+// каждый вернувшийся add. Не из счётчиков: те не знают таймеров, пришедших не через add.
+std::uint64_t active_count() {
+    std::uint64_t count = 0;
+    for (const auto& shard : g_shards) {
+        auto lock = lock_timers(*shard);
+        drain_submissions(*shard, lock);
+        count += shard->timers.count(hot_running);
+    }
+    return count;
+}
+
+void append_stats_pipe(std::string& out, const StatsSnapshot& snap, std::uint64_t active) {
+    const auto count = [&](std::string_view name, std::uint64_t value) {
+        out += "COUNT\t";
+        out += name;
+        out += '\t';
+        append_uint(out, value);
+        out += '\n';
+    };
+    count("active", active);
+    count("overdue", overdue_count());
+    count("added", snap.counters[static_cast<std::size_t>(Counter::Added)]);
+    count("fired", snap.counters[static_cast<std::size_t>(Counter::Fired)]);
+    count("rearmed", snap.counters[static_cast<std::size_t>(Counter::Rearmed)]);
+    count("cancelled", snap.counters[static_cast<std::size_t>(Counter::Cancelled)]);
+    count("dropped_events", g_log_dropped.load(std::memory_order_relaxed));
+    count("wakeups", snap.counters[static_cast<std::size_t>(Counter::Wakeups)]);
+    count("batches", snap.counters[static_cast<std::size_t>(Counter::Batches)]);
+
+    static const char* const names[kMetricCount] = {
+        "fire_lateness", "timers_lock_wait", "log_wait", "add_timer", "cancel_timer", "callback_wait"
+    };
+    for (std::size_t i = 0; i < kMetricCount; ++i) {
+        const HistogramSnapshot& h = snap.metrics[i];
+        out += "LATENCY\t";
+        out += names[i];
+        out += '\t';
+        append_uint(out, h.count);
+        for (double q : { 0.50, 0.90, 0.99, 0.999 }) {
+            out += '\t';
+            append_uint(out, h.percentile(q));
+        }
+        out += '\t';
+        append_uint(out, h.max);
+        out += '\n';
+    }
+    out += "END\tstats\n";
+}
+
+// Отчёт статистики: счётчики и перцентили всех гистограмм.
+void append_stats(std::string& out) {
+    const StatsSnapshot snap = stats_snapshot();
+    const auto counter = [&](Counter c) { return snap.counters[static_cast<std::size_t>(c)]; };
+    const std::uint64_t added = counter(Counter::Added);
+    const std::uint64_t active = active_count();
+
+    if (g_output == OutputFormat::Pipe) {
+        append_stats_pipe(out, snap, active);
+        return;
+    }
+    out += "Статистика:\n  таймеров: активно ";
+    append_uint(out, active);
+    if (const std::uint64_t overdue = overdue_count(); overdue > 0) {
+        out += " (просрочено ";
+        append_uint(out, overdue);
+        out += ')';
+    }
+    out += ", добавлено ";
+    append_uint(out, added);
+    out += ", сработало ";
+    append_uint(out, counter(Counter::Fired));
+    if (counter(Counter::Rearmed) > 0) {
+        out += " (с перевзводом ";
+        append_uint(out, counter(Counter::Rearmed));
+        out += ')';
+    }
+    out += ", отменено ";
+    append_uint(out, counter(Counter::Cancelled));
+    out += ", событий отброшено ";
+    append_uint(out, g_log_dropped.load(std::memory_order_relaxed));
+    out += ", пробуждений диспетчера ";
+    append_uint(out, counter(Counter::Wakeups));
+    out += ", пачек срабатываний ";
+    append_uint(out, counter(Counter::Batches));
+    out += '\n';
+
+    constexpr std::size_t kNameWidth = 26;
+    constexpr std::size_t kColumnWidth = 9;
+    static const char* const names[kMetricCount] = {
+        "опоздание [DONE]",
+        "ожидание мьютекса шарда",
+        "постановка в вывод",
+        "add_timer",
+        "cancel_timer",
+        "очередь колбэков"
+    };
+    static const char* const columns[] = { "всего", "p50", "p90", "p99", "p99.9", "max" };
+    static const double quantiles[] = { 0.50, 0.90, 0.99, 0.999 };
+
+    out += "  ";
+    append_padded(out, "", kNameWidth);
+    for (const char* column : columns) {
+        append_padded(out, column, kColumnWidth, true);
+    }
+    out += '\n';
+
+    std::string cell;
+    for (std::size_t i = 0; i < kMetricCount; ++i) {
+        const HistogramSnapshot& h = snap.metrics[i];
+        out += "  ";
+        append_padded(out, names[i], kNameWidth);
+        cell.clear();
+        append_uint(cell, h.count);
+        append_padded(out, cell, kColumnWidth, true);
+        for (double q : quantiles) {
+            cell.clear();
+            if (h.count == 0) cell += '-';
+            else append_latency(cell, h.percentile(q));
+            append_padded(out, cell, kColumnWidth, true);
+        }
+        cell.clear();
+        if (h.count == 0) cell += '-';
+        else append_latency(cell, h.max);
+        append_padded(out, cell, kColumnWidth, true);
+        out += '\n';
+    }
+}
+
+// Выводит статистику в консоль (команда stats).
+void print_stats() {
+    std::string& out = message_buffer();
+    append_stats(out);
+    safe_print(out);
+}
+
+std::uint64_t dispatcher_wakeups() {
+    return stats_snapshot().counters[static_cast<std::size_t>(Counter::Wakeups)];
+}
+
+// Поток периодической статистики. Отчёты идут как события, то есть при --log — в файл.
+void stats_thread_func() {
+    std::unique_lock<std::mutex> lock(g_stats_mutex);
+    while (g_running.load(std::memory_order_relaxed)) {
+        const std::chrono::seconds every = g_stats_every;
+        if (every <= std::chrono::seconds(0)) {
+            g_stats_cv.wait(lock);
+            continue;
+        }
+        // Раньше срока будят только смена интервала и выход.
+        const bool changed = g_stats_cv.wait_until(lock, Clock::now() + every, [&] {
+            return !g_running.load(std::memory_order_relaxed) || g_stats_every != every;
+        });
+        if (changed) {
+            continue;
+        }
+        lock.unlock();
+        std::string& out = message_buffer();
+        append_stats(out);
+        log_event(out);
+        lock.lock();
+    }
+}
+
+// Задаёт интервал периодической статистики; 0 — выключить.
+void set_stats_every(std::chrono::seconds every) {
+    std::lock_guard<std::mutex> lock(g_stats_mutex);
+    g_stats_every = every;
+    if (every > std::chrono::seconds(0) && !g_stats_thread.joinable() && g_running.load()) {
+        g_stats_thread = std::thread(stats_thread_func);
+    }
+    g_stats_cv.notify_all();
+}
+
+// Создаёт шарды, восстанавливает таймеры из журнала (если он задан), запускает
+// диспетчеры шардов, пул колбэков и жнеца (EngineKind::Threads), а также фоновую
+// чистку, если задан срок хранения, и периодическую статистику.
+void start_engine() {
+    if (g_shard_count == 0) {
+        g_shard_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    g_shard_count = std::min(g_shard_count, kMaxShards);
+    g_shards.clear();
+    for (std::size_t i = 0; i < g_shard_count; ++i) {
+        g_shards.push_back(std::make_unique<Shard>(i));
+    }
+    if (g_hires) {
+        precision_begin();
+        for (auto& shard : g_shards) {
+            shard->wheel.reset(Clock::now(), TimingWheel::kHiresTick);
+        }
+    }
+    if (g_power_save && !g_hires && g_engine != EngineKind::Threads) {
+        for (auto& shard : g_shards) {
+            shard->dispatcher_signal.use_idle_timer();
+        }
+    }
+    if (!g_journal_path.empty()) {
+        restore_journal();
+    }
+    for (auto& shard : g_shards) {
+        shard->dispatcher = std::thread(dispatcher_thread_func, std::ref(*shard));
+        if (g_shards.size() > 1) {
+            pin_to_core(shard->dispatcher, shard->index);
+        }
+    }
+    executor_start(g_executor_threads);
+    if (g_engine == EngineKind::Threads) {
+        g_reaper = std::thread(reaper_thread_func);
+    }
+    if (g_retention.keep_for > std::chrono::seconds(0)) {
+        for (auto& shard : g_shards) {
+            shard->compactor = std::thread(compactor_thread_func, std::ref(*shard));
+        }
+    }
+    set_stats_every(g_stats_every);
+}
+
+// Создаёт новый таймер в шарде текущего потока: резервирует id и отдаёт заявку
+// диспетчеру шарда через lock-free очередь, а тот уже запускает для таймера поток
+// либо кладёт его в колесо.
+// Возвращает id созданного таймера или kInvalidTimer в случае ошибки.
+TimerId add_timer(std::chrono::milliseconds duration, std::string_view label, TimerCallback on_fire) {
+    const Clock::time_point called = Clock::now();
+    if (duration <= std::chrono::milliseconds(0)) {
+        print_error("bad_duration", "Длительность должна быть > 0.\n");
+        return kInvalidTimer;
+    }
+
+    Shard& shard = home_shard();
+    TimerSubmission sub;
+    sub.id = shard.timers.reserve();
+    if (sub.id == kInvalidTimer) {
+        print_error("too_many_timers", "Слишком много таймеров.\n");
+        return kInvalidTimer;
+    }
+    const TimerId id = sub.id;
+    if (label.empty()) {
+        label = "Без названия";
+    }
+    sub.label = PooledLabel(label);
+    sub.total = duration;
+    sub.start = called;
+    sub.end = sub.start + duration;
+    sub.on_fire = std::move(on_fire);
+
+    if (shard.submissions.try_push(std::move(sub))) {
+        wake_dispatcher(shard);
+    }
+    else {
+        // Очередь переполнена — диспетчер не успевает; создаём запись сами под мьютексом.
+        // Сначала разбираем очередь, чтобы не обогнать более ранние заявки.
+        auto lock = lock_timers(shard);
+        drain_submissions(shard, lock);
+        materialize_submission(shard, sub);
+        if (g_engine != EngineKind::Threads && queue_wake(shard) < shard.dispatcher_wake) {
+            wake_dispatcher(shard);
+        }
+    }
+
+    std::string& msg = message_buffer();
+    append_event(msg, EventKind::Add, id, label, duration);
+    log_event(msg);
+
+    stats_count(Counter::Added);
+    stats_record(Metric::AddLatency, Clock::now() - called);
+    return id;
+}
+
+// Добавляет пачку таймеров в шард текущего потока: все записи создаются за один захват его мьютекса,
+// минуя очередь заявок, диспетчер будится один раз, вместо строки [ADD] на таймер —
+// одна строка итога. Метки копируются в пул меток. Возвращает число добавленных.
+std::size_t add_timers(std::vector<TimerSpec>& specs) {
+    const Clock::time_point called = Clock::now();
+    std::size_t added = 0;
+    std::size_t rejected = 0;
+    TimerId first = kInvalidTimer;
+    TimerId last = kInvalidTimer;
+    bool full = false;
+    {
+        Shard& shard = home_shard();
+        auto lock = lock_timers(shard);
+        drain_submissions(shard, lock);
+        for (TimerSpec& spec : specs) {
+            if (spec.duration <= std::chrono::milliseconds(0)) {
+                ++rejected;
+                continue;
+            }
+            TimerSubmission sub;
+            sub.id = shard.timers.reserve();
+            if (sub.id == kInvalidTimer) {
+                full = true;
+                break;
+            }
+            sub.label = PooledLabel(spec.label.empty() ? std::string_view("Без названия") : spec.label);
+            sub.total = spec.duration;
+            sub.start = called;
+            sub.end = called + spec.duration;
+            if (first == kInvalidTimer) first = sub.id;
+            last = sub.id;
+            materialize_submission(shard, sub);
+            ++added;
+        }
+        if (added > 0 && g_engine != EngineKind::Threads && queue_wake(shard) < shard.dispatcher_wake) {
+            wake_dispatcher(shard);
+        }
+    }
+    // В гистограмму add_timer пачки не попадают: одна пачка исказила бы её распределение.
+    stats_count(Counter::Added, added);
+
+    std::string& msg = message_buffer();
+    if (g_output == OutputFormat::Pipe) {
+        // BATCH\t<добавлено>\t<первый id>\t<последний id>\t<отклонено>\t<1, если кончились слоты>
+        msg += "BATCH\t";
+        append_uint(msg, added);
+        msg += '\t';
+        append_uint(msg, first);
+        msg += '\t';
+        append_uint(msg, last);
+        msg += '\t';
+        append_uint(msg, rejected);
+        msg += full ? "\t1\n" : "\t0\n";
+        log_event(msg);
+        return added;
+    }
+    msg += "[ADD]  пачка таймеров: ";
+    append_uint(msg, added);
+    if (added > 0) {
+        msg += ", #";
+        append_uint(msg, first);
+        msg += " ... #";
+        append_uint(msg, last);
+    }
+    if (rejected > 0) {
+        msg += ", отклонено с длительностью <= 0: ";
+        append_uint(msg, rejected);
+    }
+    if (full) {
+        msg += ", остальные не добавлены: слишком много таймеров";
+    }
+    msg += '\n';
+    log_event(msg);
+    return added;
+}
+
+// Цепочка фаз одним таймером (см. TimerChain). Запись создаётся сразу под мьютексом,
+// как в add_timers: цепочки редки, и очередь заявок им не нужна.
+// Возвращает id созданного таймера или kInvalidTimer в случае ошибки.
+TimerId add_chain(std::vector<TimerSpec> phases, bool repeat, TimerCallback on_fire) {
+    const Clock::time_point called = Clock::now();
+    if (phases.empty() || phases.size() > kMaxChainPhases) {
+        print_error("bad_chain", "В цепочке должно быть от 1 до 65535 фаз.\n");
+        return kInvalidTimer;
+    }
+    for (TimerSpec& phase : phases) {
+        if (phase.duration <= std::chrono::milliseconds(0)) {
+            print_error("bad_duration", "Длительность должна быть > 0.\n");
+            return kInvalidTimer;
+        }
+        if (phase.label.empty()) {
+            phase.label = "Без названия";
+        }
+    }
+
+    Shard& shard = home_shard();
+    TimerSubmission sub;
+    sub.id = shard.timers.reserve();
+    if (sub.id == kInvalidTimer) {
+        print_error("too_many_timers", "Слишком много таймеров.\n");
+        return kInvalidTimer;
+    }
+    const TimerId id = sub.id;
+    sub.total = phases[0].duration;
+    sub.start = called;
+    sub.end = called + sub.total;
+    sub.chain = std::make_unique<TimerChain>();
+    sub.chain->phases = std::move(phases);
+    sub.chain->repeat = repeat;
+    sub.on_fire = std::move(on_fire);
+    std::string& msg = message_buffer();
+    append_event(msg, EventKind::Add, id, sub.chain->phases[0].label, sub.total);
+    {
+        auto lock = lock_timers(shard);
+        drain_submissions(shard, lock);
+        materialize_submission(shard, sub);
+        if (g_engine != EngineKind::Threads && queue_wake(shard) < shard.dispatcher_wake) {
+            wake_dispatcher(shard);
+        }
+    }
+    log_event(msg);
+
+    stats_count(Counter::Added);
+    stats_record(Metric::AddLatency, Clock::now() - called);
+    return id;
+}
+
+// Выводит список таймеров и их состояние, шард за шардом.
+// Мьютекс шарда берётся только на разбор заявок и чистку; обход таблиц и форматирование
+// идут без него (TimerTable::read_each), так что list не задерживает add/cancel и диспетчеры.
+void list_timers(const ListFilter& filter) {
+    for (auto& shard : g_shards) {
+        auto lock = lock_timers(*shard);
+        drain_submissions(*shard, lock);
+        compact_retired(*shard, Clock::now());
+    }
+
+    const bool pipe = g_output == OutputFormat::Pipe;
+    auto now = Clock::now();
+    std::string& out = message_buffer();
+    if (!pipe) {
+        out += "Таймеры:\n";
+    }
+    std::size_t shown = 0;
+    std::size_t skipped = 0; // Подошли под фильтр, но не влезли в --limit.
+
+    // Фильтр running и подсчёт не влезших в --limit идут по горячему столбцу таблицы.
+    const auto accept = [&](std::uint64_t word) { return !filter.running_only || hot_running(word); };
+    const auto row = [&](const TimerInfo& t, std::uint64_t word) {
+        if (shown >= filter.limit) {
+            return false;
+        }
+        ++shown;
+        const TimerState state = hot_state(word);
+
+        std::string_view label;
+        Clock::time_point end;
+        std::size_t phase = 0;
+        if (t.chain) {
+            // t.end цепочки не читаем: его под мьютексом шарда меняет перевзвод.
+            const std::uint64_t packed = t.chain->shown.load(std::memory_order_acquire);
+            phase = static_cast<std::size_t>(packed >> 48);
+            label = t.chain->phases[phase].label;
+            end = Clock::time_point(std::chrono::milliseconds(packed & kShownEndMask));
+        }
+        else {
+            label = t.label;
+            end = t.end;
+        }
+
+        if (pipe) {
+            // TIMER\t<id>\t<состояние>\t<осталось, мс>\t<label>
+            out += "TIMER\t";
+            append_uint(out, t.id);
+            std::uint64_t remaining_ms = 0;
+            if (state == TimerState::Cancelled) {
+                out += "\tCANCELLED";
+            }
+            else if (state == TimerState::Done) {
+                out += "\tDONE";
+            }
+            else if (now >= end) {
+                out += "\tPENDING";
+            }
+            else {
+                out += "\tRUNNING";
+                remaining_ms = static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(end - now).count());
+            }
+            out += '\t';
+            append_uint(out, remaining_ms);
+            append_field(out, label);
+            out += '\n';
+            return true;
+        }
+
+        out += "  #";
+        append_uint(out, t.id);
+        out += " \"";
+        out += label;
+        out += "\" ";
+
+        if (state == TimerState::Cancelled) {
+            out += "[CANCELLED]";
+        }
+        else if (state == TimerState::Done) {
+            out += "[DONE]";
+        }
+        else {
+            if (now >= end) {
+                // таймер уже должен был сработать, но поток ещё не отметил Done.
+                out += "[PENDING DONE]";
+            }
+            else {
+                auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(end - now);
+                out += "[RUNNING, осталось ";
+                append_duration(out, remaining);
+                if (t.chain && t.chain->phases.size() > 1) {
+                    out += ", фаза ";
+                    append_uint(out, phase + 1);
+                    out += '/';
+                    append_uint(out, t.chain->phases.size());
+                }
+                if (t.chain && t.chain->repeat) {
+                    out += ", по кругу";
+                }
+                out += ']';
+            }
+        }
+
+        out += '\n';
+        return true;
+    };
+    for (const auto& shard : g_shards) {
+        skipped += shard->timers.read_each(accept, row);
+    }
+
+    if (pipe) {
+        // Конец ответа: END\tlist\t<показано>\t<не влезло в --limit>
+        out += "END\tlist\t";
+        append_uint(out, shown);
+        out += '\t';
+        append_uint(out, skipped);
+        out += '\n';
+        safe_print(out);
+        return;
+    }
+    if (shown == 0 && skipped == 0) {
+        safe_print(filter.running_only ? "Активных таймеров нет.\n" : "Активных/завершённых таймеров нет.\n");
+        return;
+    }
+    if (skipped > 0) {
+        out += "  ... и ещё ";
+        append_uint(out, skipped);
+        out += '\n';
+    }
+    safe_print(out);
+}
+
+// Число записей во всех шардах, включая ещё не разобранные заявки из очередей.
+std::size_t timer_count() {
+    std::size_t count = 0;
+    for (auto& shard : g_shards) {
+        auto lock = lock_timers(*shard);
+        drain_submissions(*shard, lock);
+        count += shard->timers.size();
+    }
+    return count;
+}
+
+// Отмена конкретного таймера по id. Берёт мьютекс только шарда из id.
+// Только помечает таймер и будит его поток; сам поток выходит и
+// отдаётся жнецу без ожидания здесь, слот колеса отбрасывается диспетчером.
+enum class CancelResult {
+    Cancelled,
+    NotFound,
+    Finished  // Уже сработал или отменён.
+};
+
+// Отменяет таймер; ошибки не печатает. Колбэк отменённого таймера уходит в пул с TimerOutcome::Cancelled.
+CancelResult cancel_record(TimerId id) {
+    const Clock::time_point called = Clock::now();
+    std::string& msg = message_buffer();
+    PendingCallbacks callbacks;
+    CancelResult result = CancelResult::NotFound;
+    Shard* shard = find_shard(id);
+    if (shard) {
+        auto lock = lock_timers(*shard);
+        drain_submissions(*shard, lock);
+
+        TimerInfo* t = shard->timers.find(id);
+        if (t) {
+            result = CancelResult::Finished;
+        }
+        if (t && try_finish(*t, TimerState::Cancelled)) {
+            wake_timer(*t);
+            append_event(msg, EventKind::Cancel, id, current_label(*t));
+            if (t->on_fire) {
+                queue_callback(callbacks, id, TimerOutcome::Cancelled, std::move(t->on_fire));
+            }
+            journal_cancel(shard->journal, id);
+            note_retired(*shard, id);
+            result = CancelResult::Cancelled;
+        }
+    }
+    if (result == CancelResult::Cancelled) {
+        flush_journal(*shard);
+        log_event(msg);
+        submit_callbacks(*shard, callbacks);
+        stats_count(Counter::Cancelled);
+    }
+    stats_record(Metric::CancelLatency, Clock::now() - called);
+    return result;
+}
+
+void cancel_timer(TimerId id) {
+    switch (cancel_record(id)) {
+    case CancelResult::Cancelled:
+        break;
+    case CancelResult::NotFound:
+        print_error("not_found", "Таймер с таким id не найден.\n", std::to_string(id));
+        break;
+    case CancelResult::Finished:
+        print_error("finished", "Таймер уже завершён или отменён.\n", std::to_string(id));
+        break;
+    }
+}
+
+bool try_cancel_timer(TimerId id) {
+    return cancel_record(id) == CancelResult::Cancelled;
+}
+
+// Останавливает приложение и корректно завершает все таймеры.
+// Вызывается при выходе из main, в том числе по сигналу.
+void shutdown_all(ShutdownMode mode, bool snapshot) {
+    g_running.store(false);
+
+    // Диспетчеры и чистка заходят в мьютексы шардов, поэтому их останавливаем до захвата мьютексов.
+    for (auto& shard : g_shards) {
+        wake_dispatcher(*shard);
+        auto lock = lock_timers(*shard);
+        shard->compactor_cv.notify_all();
+    }
+    for (auto& shard : g_shards) {
+        if (shard->dispatcher.joinable()) {
+            shard->dispatcher.join();
+        }
+        if (shard->compactor.joinable()) {
+            shard->compactor.join();
+        }
+    }
+    // Уже поставленные колбэки доделываются (в ShutdownMode::Fast — отбрасываются).
+    // Таймеры, которые они добавят, попадут в очереди шардов и в журнал при разборе ниже.
+    executor_stop(mode == ShutdownMode::Graceful);
+    {
+        std::lock_guard<std::mutex> lock(g_stats_mutex);
+        g_stats_cv.notify_all();
+    }
+    if (g_stats_thread.joinable()) {
+        g_stats_thread.join();
+    }
+
+    // Будим потоки всех таймеров (они увидят сброшенный g_running и выйдут тихо,
+    // не меняя состояния) и забираем их std::thread из таблицы. Потоки есть только
+    // у EngineKind::Threads, у очередей записи не обходим.
+    // Join — уже без мьютексов шардов: выходящие потоки сами заходят в мьютекс своего шарда.
+    // Колбэки ожидающих таймеров больше не вызовутся: забираем их и уничтожаем тоже без
+    // мьютексов — с колбэком уходит то, что он держит (кадр корутины, см. TimerCoroutine.h).
+    std::vector<std::thread> workers;
+    std::vector<TimerCallback> dropped;
+    for (auto& shard : g_shards) {
+        auto lock = lock_timers(*shard);
+        drain_submissions(*shard, lock);
+        shard->timers.for_each(hot_running, [&](TimerInfo& t, std::uint64_t) {
+            if (t.on_fire) {
+                dropped.push_back(std::move(t.on_fire));
+            }
+        });
+        if (g_engine != EngineKind::Threads) {
+            continue;
+        }
+        shard->timers.for_each([](std::uint64_t) { return true; }, [&](TimerInfo& t, std::uint64_t) {
+            wake_timer(t);
+            if (t.worker.joinable()) {
+                workers.push_back(std::move(t.worker));
+            }
+        });
+    }
+    // Оставшиеся Running таймеры уже в журнале и восстановятся при следующем запуске.
+    for (auto& shard : g_shards) {
+        flush_journal(*shard);
+    }
+    if (snapshot && journal_is_open()) {
+        auto locks = lock_all_shards();
+        compact_journal();
+    }
+    journal_close();
+    dropped.clear();
+
+    // Дожидаемся завершения всех потоков.
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // Жнец дочищает потоки, отданные ему раньше, и выходит.
+    {
+        std::lock_guard<std::mutex> lock(g_reaper_mutex);
+        g_reaper_stop = true;
+    }
+    g_reaper_cv.notify_all();
+    if (g_reaper.joinable()) {
+        g_reaper.join();
+    }
+    if (g_hires) {
+        precision_end();
+    }
+}
@@ -0,0 +1,167 @@
+﻿#pragma once
+
+// Движок таймеров: хранение, отсчёт, вывод событий.
+// Общий для приложения (Multithreaded Task Timer.cpp) и бенчмарка (Benchmark.cpp).
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Идентификатор таймера: биты 0-23 — номер слота в TimerTable шарда + 1, 24-31 — номер
+// шарда, старшие 32 — поколение слота. 0 — недействительный id. У шарда 0 (и при одном
+// шарде) id те же, что были до шардов: 1, 2, 3...
+using TimerId = std::uint64_t;
+constexpr TimerId kInvalidTimer = 0;
+constexpr int kTimerShardShift = 24;
+constexpr TimerId kTimerSlotMask = (TimerId{ 1 } << kTimerShardShift) - 1;
+constexpr std::size_t kMaxShards = 256;
+
+inline std::size_t shard_of(TimerId id) {
+    return static_cast<std::size_t>((id >> kTimerShardShift) & (kMaxShards - 1));
+}
+
+// Способ отсчёта таймеров.
+enum class EngineKind {
+    Threads, // Отдельный поток на каждый таймер (исходная схема).
+    Wheel,   // Иерархическое колесо и поток-диспетчер на каждый шард (--shards).
+    Heap     // Куча сроков вместо колеса: диспетчер спит ровно до ближайшего срока
+             // и не просыпается ради каскадов — для редких долгих таймеров.
+};
+
+// Сколько хранить завершённые и отменённые таймеры, чтобы память и list не росли бесконечно.
+// Запись удаляется, как только нарушено любое из ограничений.
+struct RetentionPolicy {
+    std::size_t keep_last = 1000;                 // Не больше стольких последних записей.
+    std::chrono::seconds keep_for{ 0 };           // Не дольше этого после завершения; 0 — без ограничения.
+};
+
+// Таймер для add_timers.
+struct TimerSpec {
+    std::chrono::milliseconds duration{ 0 };
+    std::string label;
+};
+
+// Отбор строк для list_timers.
+struct ListFilter {
+    bool running_only = false;                    // list running: только ещё не сработавшие и не отменённые.
+    std::size_t limit = SIZE_MAX;                 // list --limit N: не больше N строк.
+};
+
+// Вид вывода ответов и событий.
+enum class OutputFormat {
+    Text, // Для человека: сообщения по-русски, события [ADD]/[DONE]/[CANCEL].
+    Pipe  // --pipe: по строке на ответ или событие, поля через табуляцию, первое — тип строки.
+};
+
+// Вызывается при каждом срабатывании (под мьютексом шарда, поэтому должен быть коротким;
+// при нескольких шардах — из нескольких потоков сразу):
+// end — назначенный срок, fired — момент, когда движок его обработал.
+using FireHook = void (*)(TimerId id, Clock::time_point end, Clock::time_point fired);
+
+// Чем закончилось ожидание таймера для его колбэка.
+enum class TimerOutcome {
+    Fired,     // Срок наступил.
+    Cancelled  // cancel_timer / try_cancel_timer; после этого колбэк больше не вызывается.
+};
+
+// Работа по срабатыванию таймера (add_timer/add_chain с on_fire): выполняется в пуле
+// исполнителей (--workers), а не в диспетчере и не в потоке таймера, так что медленный
+// колбэк не задерживает другие срабатывания. У цепочки вызывается на каждой фазе.
+// Отменённый таймер вызывает колбэк с TimerOutcome::Cancelled. Таймеры, ожидающие
+// при shutdown_all, колбэк не вызывают: shutdown_all уничтожает его (вне мьютексов
+// движка), как и уже поставленные в пул, но не выполненные колбэки. Колбэк не
+// сохраняется в журнал: восстановленный таймер срабатывает без него.
+using TimerCallback = std::function<void(TimerId id, TimerOutcome outcome)>;
+
+// Глобальный флаг работы приложения. Используется для мягкого завершения всех потоков.
+extern std::atomic<bool> g_running;
+
+// Настройки движка; задаются до start_engine().
+extern EngineKind g_engine;
+extern RetentionPolicy g_retention;
+extern FireHook g_fire_hook;
+extern std::chrono::seconds g_stats_every;      // --stats-every: печатать статистику каждые N секунд.
+extern std::string g_journal_path;              // --journal: файл, где таймеры переживают перезапуск.
+extern bool g_hires;                            // --hires: тик колеса 1 мс и точное ожидание срока; до start_log().
+// --slack: на сколько диспетчер шарда может отложить срабатывание, чтобы таймеры с близкими
+// сроками сработали одной пачкой — одно пробуждение, одна строка вывода на пачку, одна
+// постановка колбэков в пул (как timer slack в Linux). 0 — не откладывать. Не для Threads.
+extern std::chrono::milliseconds g_slack;
+// --power-save[=<мс>]: диспетчеры шардов ждут срок на таймере ОС с допуском g_power_tolerance
+// (IdleTimer), и простаивающий процесс почти не будит процессор. В отличие от g_slack,
+// срок откладывает ОС, сводя его с чужими таймерами. С --hires не действует; не для Threads.
+extern bool g_power_save;
+extern std::chrono::milliseconds g_power_tolerance;
+// --shards: число шардов, у каждого своя таблица, колесо, мьютекс и диспетчер,
+// прикреплённый к своему ядру. Поток, добавляющий таймеры, пишет в «свой» шард,
+// cancel идёт прямо в шард из id. 1..kMaxShards; 0 — по числу ядер.
+extern std::size_t g_shard_count;
+extern std::size_t g_executor_threads;          // --workers: потоков пула колбэков; 0 — по числу ядер.
+
+// Настройки вывода; задаются до start_log().
+extern std::ofstream g_log_file;               // Открыт — события пишутся в него (--log).
+extern bool g_log_drop;                        // --log-drop: при переполнении события отбрасываются.
+extern std::atomic<std::uint64_t> g_log_dropped;
+extern OutputFormat g_output;
+
+// Вызывается с каждым событием, которое не стало ответом команды (см. set_reply_sink):
+// [DONE], [NEXT], EXIT и т. п. из потоков движка — вне мьютексов шардов, из любых потоков.
+// Задаётся до start_engine().
+using EventHook = void (*)(std::string_view events);
+extern EventHook g_event_hook;
+
+void start_log();
+// Дописывает всё из очереди и останавливает писателя. Вызывается последним.
+void stop_log();
+
+// Вывод в консоль. 
+void safe_print(std::string_view msg);
+// Событие таймера ([ADD]/[DONE]/[CANCEL]).
+void log_event(std::string_view msg);
+// Ошибка команды: в Text печатает text, в Pipe — "ERR\t<code>[\t<detail>]".
+void print_error(std::string_view code, std::string_view text, std::string_view detail = {});
+// Ответы команд текущего потока — в строку, а не в консоль (сервер --listen): пока
+// приёмник задан, safe_print и print_error дописывают в него, а log_event — и в него,
+// и в вывод событий, но не в g_event_hook. nullptr — снова в консоль.
+void set_reply_sink(std::string* sink);
+
+// Как завершаться shutdown_all.
+enum class ShutdownMode {
+    Graceful, // Выполнить колбэки, уже поставленные в пул.
+    Fast      // По сигналу: поставленные колбэки отбрасываются, ждём только выполняющиеся.
+};
+
+void start_engine();
+// Останавливает приложение и корректно завершает все таймеры: будит все ожидания сразу
+// и обходит только записи таблиц, без ожидания сроков. snapshot — перед закрытием
+// свернуть журнал (--journal) в снимок, чтобы следующий запуск не перечитывал историю.
+// Не async-signal-safe: из обработчика сигнала только выставляют флаг (см. main).
+void shutdown_all(ShutdownMode mode = ShutdownMode::Graceful, bool snapshot = false);
+
+// Возвращает id созданного таймера или kInvalidTimer в случае ошибки.
+TimerId add_timer(std::chrono::milliseconds duration, std::string_view label, TimerCallback on_fire = {});
+// Цепочка фаз одним таймером: фазы идут одна за другой, и по срабатыванию фазы ([DONE])
+// таймер перевзводится на следующую ([NEXT]) с тем же id, без новой записи и потока.
+// repeat — после последней фазы снова первая, до отмены. Одна фаза с repeat — повтор каждые N.
+TimerId add_chain(std::vector<TimerSpec> phases, bool repeat, TimerCallback on_fire = {});
+// Пачка таймеров за один захват мьютекса и с одной строкой итога. Возвращает число добавленных.
+std::size_t add_timers(std::vector<TimerSpec>& specs);
+void list_timers(const ListFilter& filter = {});
+std::size_t timer_count();
+void cancel_timer(TimerId id);
+// То же без сообщений об ошибке; true — таймер был ожидающим и отменён сейчас.
+bool try_cancel_timer(TimerId id);
+
+// Счётчики и гистограммы задержек (опоздание срабатываний, ожидание мьютекса,
+// add/cancel). Периодический вывод идёт как события; 0 — выключить.
+void print_stats();
+// Сколько раз диспетчеры шардов просыпались с запуска (по сроку или по сигналу).
+std::uint64_t dispatcher_wakeups();
+void set_stats_every(std::chrono::seconds every);
@@ -0,0 +1,197 @@
+﻿#include "TimerExecutor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#pragma execution_character_set("utf-8")
+#endif
+
+// Очередь одного потока. Владелец берёт задачи с головы (в порядке постановки),
+// воры — с хвоста, так что они встречаются на мьютексе, только когда в очереди
+// осталась последняя задача. Мьютекс на очередь, а не lock-free дек Чейза — Лева:
+// ставят задачи не владельцы, а диспетчеры шардов, и дек с одним писателем сюда не подходит.
+struct alignas(64) WorkerQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    bool closed = false; // Под mutex: после executor_stop задачи не принимаются.
+};
+
+// Очереди живут до следующего executor_start, а не до executor_stop: потоки таймеров
+// (EngineKind::Threads) ставят колбэки, пока их не разбудят и не дождутся в shutdown_all,
+// то есть и после остановки пула. Такие задачи отбрасывает closed.
+std::vector<std::unique_ptr<WorkerQueue>> g_worker_queues;
+std::vector<std::thread> g_workers;
+
+// Задач во всех очередях. Поток засыпает, только увидев 0 под g_idle_mutex.
+std::atomic<std::size_t> g_pending{ 0 };
+std::atomic<std::size_t> g_sleeping{ 0 };
+std::mutex g_idle_mutex;
+std::condition_variable g_idle_cv;
+bool g_executor_stop = false; // Под g_idle_mutex.
+
+bool take_own(WorkerQueue& q, std::function<void()>& out) {
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty()) {
+        return false;
+    }
+    out = std::move(q.tasks.front());
+    q.tasks.pop_front();
+    return true;
+}
+
+bool steal(WorkerQueue& q, std::function<void()>& out) {
+    std::unique_lock<std::mutex> lock(q.mutex, std::try_to_lock);
+    if (!lock.owns_lock() || q.tasks.empty()) {
+        return false; // Занятую очередь не ждём — смотрим следующую.
+    }
+    out = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+}
+
+// Своя очередь, затем чужие по кругу начиная с соседней.
+bool find_task(std::size_t self, std::function<void()>& out) {
+    if (take_own(*g_worker_queues[self], out)) {
+        return true;
+    }
+    const std::size_t n = g_worker_queues.size();
+    for (std::size_t i = 1; i < n; ++i) {
+        if (steal(*g_worker_queues[(self + i) % n], out)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void worker_func(std::size_t self) {
+    std::function<void()> task;
+    while (true) {
+        if (find_task(self, task)) {
+            g_pending.fetch_sub(1);
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(g_idle_mutex);
+        // Счётчик спящих поднимается до проверки g_pending, а executor_submit
+        // поднимает g_pending до проверки спящих: хотя бы одна сторона увидит другую.
+        g_sleeping.fetch_add(1);
+        // steal пропускает занятые очереди, поэтому g_pending > 0 — повод поискать снова.
+        g_idle_cv.wait(lock, [] { return g_pending.load() > 0 || g_executor_stop; });
+        g_sleeping.fetch_sub(1);
+        if (g_executor_stop && g_pending.load() == 0) {
+            return;
+        }
+    }
+}
+
+void executor_start(std::size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    g_executor_stop = false;
+    g_worker_queues.clear(); // От прошлого запуска; ставящих в них потоков уже нет.
+    for (std::size_t i = 0; i < threads; ++i) {
+        g_worker_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (std::size_t i = 0; i < threads; ++i) {
+        g_workers.emplace_back(worker_func, i);
+    }
+}
+
+void executor_submit(std::size_t hint, std::function<void()> task) {
+    if (g_worker_queues.empty()) {
+        return;
+    }
+    WorkerQueue& q = *g_worker_queues[hint % g_worker_queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.closed) {
+            return;
+        }
+        // Счёт до постановки и под мьютексом очереди: забрать задачу можно только под ним,
+        // и вычитание не обгонит прибавление.
+        g_pending.fetch_add(1);
+        q.tasks.push_back(std::move(task));
+    }
+    if (g_sleeping.load() > 0) {
+        // Захват мьютекса не даёт уведомлению проскочить между проверкой и сном потока.
+        { std::lock_guard<std::mutex> lock(g_idle_mutex); }
+        g_idle_cv.notify_one();
+    }
+}
+
+void executor_submit_batch(std::size_t hint, std::vector<std::function<void()>>& tasks) {
+    if (tasks.empty()) {
+        return;
+    }
+    if (g_worker_queues.empty()) {
+        tasks.clear();
+        return;
+    }
+    WorkerQueue& q = *g_worker_queues[hint % g_worker_queues.size()];
+    const std::size_t n = tasks.size();
+    bool closed = false;
+    {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        closed = q.closed;
+        if (!closed) {
+            g_pending.fetch_add(n);
+            for (auto& task : tasks) {
+                q.tasks.push_back(std::move(task));
+            }
+        }
+    }
+    // Отброшенные задачи уничтожаются уже без мьютекса очереди (см. drop_queued).
+    tasks.clear();
+    if (closed) {
+        return;
+    }
+    if (g_sleeping.load() > 0) {
+        { std::lock_guard<std::mutex> lock(g_idle_mutex); }
+        // Остальные задачи пачки спящие потоки заберут кражей.
+        if (n > 1) g_idle_cv.notify_all();
+        else g_idle_cv.notify_one();
+    }
+}
+
+// Выбрасывает задачи очередей; close — больше не принимать новых.
+void drop_queued(bool close) {
+    for (auto& q : g_worker_queues) {
+        std::deque<std::function<void()>> dropped;
+        {
+            std::lock_guard<std::mutex> lock(q->mutex);
+            q->closed = q->closed || close;
+            g_pending.fetch_sub(q->tasks.size());
+            dropped.swap(q->tasks);
+        }
+        // Уничтожаем без мьютекса: вместе с задачей уходит и то, что она держит
+        // (кадр ожидающей корутины), а его деструкторы могут снова ставить задачи.
+    }
+}
+
+void executor_stop(bool run_queued) {
+    if (!run_queued) {
+        drop_queued(false);
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_idle_mutex);
+        g_executor_stop = true;
+    }
+    g_idle_cv.notify_all();
+    for (auto& worker : g_workers) {
+        worker.join();
+    }
+    g_workers.clear();
+    // Закрываем только теперь: пока потоки работали, колбэки ставили новые задачи
+    // (отмена таймера с колбэком) и те выполнялись. Поставленное после выхода потоков
+    // выполнять некому.
+    drop_queued(true);
+}
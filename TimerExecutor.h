@@ -0,0 +1,25 @@
+﻿#pragma once
+
+// Пул исполнителей колбэков таймеров (add_timer с on_fire). Работа по срабатыванию
+// не выполняется ни в диспетчере, ни в потоке таймера: она уходит сюда, и медленный
+// колбэк задерживает только другие колбэки, но не срабатывания.
+// Фиксированное число потоков, у каждого своя очередь; простаивающий поток забирает
+// работу из чужих очередей (work stealing). Внутренний заголовок движка (TimerEngine.cpp).
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Запускает threads потоков (0 — по числу ядер).
+void executor_start(std::size_t threads);
+// Ставит задачу в очередь потока hint (по модулю числа потоков): у задач одного шарда
+// одна «своя» очередь. Без запущенного пула и после executor_stop задача отбрасывается;
+// вызывать можно из любого потока, в том числе одновременно с executor_stop.
+void executor_submit(std::size_t hint, std::function<void()> task);
+// То же для пачки задач разом: один захват очереди и одно пробуждение спящих потоков.
+// Задачи забираются из tasks (вектор остаётся пустым).
+void executor_submit_batch(std::size_t hint, std::vector<std::function<void()>>& tasks);
+// Останавливает потоки. run_queued — сначала выполнить уже поставленные задачи;
+// иначе они отбрасываются, и ждём только тех, что уже выполняются. Новые задачи
+// после этого не принимаются, но очереди остаются до следующего executor_start.
+void executor_stop(bool run_queued = true);
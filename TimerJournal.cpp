@@ -0,0 +1,723 @@
+﻿#include "TimerJournal.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+#ifdef _WIN32
+#define NOMINMAX // Иначе макросы min/max из windows.h ломают std::min/std::max.
+#include <windows.h>
+#pragma execution_character_set("utf-8")
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Файл, целиком отображённый в память для чтения и записи.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    // Открывает файл (при create — создаёт). Пустой файл не отображается: size() == 0.
+    bool open(const std::string& path, bool create);
+    // Меняет размер файла и отображает его заново; прежний data() недействителен.
+    bool resize(std::size_t size);
+    // Сбрасывает изменения на диск.
+    void flush();
+    void close();
+
+    bool is_open() const;
+    char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+private:
+    bool map();
+    void unmap();
+
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+    char* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path, bool create) {
+    file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+        create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size{};
+    GetFileSizeEx(file_, &size);
+    size_ = static_cast<std::size_t>(size.QuadPart);
+    return size_ == 0 || map();
+}
+
+bool MappedFile::map() {
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+    if (!mapping_) {
+        return false;
+    }
+    data_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    return data_ != nullptr;
+}
+
+void MappedFile::unmap() {
+    if (data_) {
+        UnmapViewOfFile(data_);
+        data_ = nullptr;
+    }
+    if (mapping_) {
+        CloseHandle(mapping_);
+        mapping_ = nullptr;
+    }
+}
+
+bool MappedFile::resize(std::size_t size) {
+    unmap();
+    LARGE_INTEGER pos{};
+    pos.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFilePointerEx(file_, pos, nullptr, FILE_BEGIN) || !SetEndOfFile(file_)) {
+        return false;
+    }
+    size_ = size;
+    return map();
+}
+
+void MappedFile::flush() {
+    if (data_) {
+        FlushViewOfFile(data_, 0);
+        FlushFileBuffers(file_);
+    }
+}
+
+void MappedFile::close() {
+    unmap();
+    if (file_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+    }
+    size_ = 0;
+}
+
+bool MappedFile::is_open() const {
+    return file_ != INVALID_HANDLE_VALUE;
+}
+
+// Атомарно подменяет файл to файлом from.
+bool replace_file(const std::string& from, const std::string& to) {
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path, bool create) {
+    fd_ = ::open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd_ < 0) {
+        return false;
+    }
+    struct stat st {};
+    fstat(fd_, &st);
+    size_ = static_cast<std::size_t>(st.st_size);
+    return size_ == 0 || map();
+}
+
+bool MappedFile::map() {
+    void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    data_ = static_cast<char*>(p);
+    return true;
+}
+
+void MappedFile::unmap() {
+    if (data_) {
+        munmap(data_, size_);
+        data_ = nullptr;
+    }
+}
+
+bool MappedFile::resize(std::size_t size) {
+    unmap();
+    if (ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+        return false;
+    }
+    size_ = size;
+    return map();
+}
+
+void MappedFile::flush() {
+    if (data_) {
+        msync(data_, size_, MS_SYNC);
+    }
+}
+
+void MappedFile::close() {
+    unmap();
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    size_ = 0;
+}
+
+bool MappedFile::is_open() const {
+    return fd_ >= 0;
+}
+
+bool replace_file(const std::string& from, const std::string& to) {
+    return std::rename(from.c_str(), to.c_str()) == 0;
+}
+
+#endif
+
+// Формат файла: JournalHeader, затем записи подряд. Каждая запись — JournalRecord;
+// у Add за ним JournalAddTail и метка, дополненная до кратного 8 размера.
+// У Chain за JournalAddTail (срок и длительность текущей фазы) — JournalChainHead,
+// count записей JournalPhase и подряд метки фаз; label_size — размер всего этого.
+// Каждый перевзвод цепочки дописывает Chain заново, последняя запись по id и действует.
+// Запись сначала дописывается целиком и только потом учитывается в used,
+// так что оборванная при падении процесса запись при восстановлении не видна.
+constexpr char kJournalMagic[8] = { 'M', 'T', 'T', 'J', 'R', 'N', 'L', '1' };
+// 2 — записи Chain, 3 — длительности в миллисекундах. Более старые файлы читаются.
+constexpr std::uint32_t kJournalVersion = 3;
+
+struct JournalHeader {
+    char magic[8];
+    std::uint32_t version;
+    // Больше поколения любого id, записанного в журнал за всю его историю, в том числе
+    // свёрнутых снимком: новые id после перезапуска начинаются с него. В старых файлах 0.
+    std::uint32_t generation;
+    std::uint64_t used;     // Байт записей после заголовка.
+    std::uint64_t snapshot; // Из них — снимок в начале.
+};
+
+enum class JournalRecordType : std::uint8_t {
+    Add = 1,
+    Cancel = 2,
+    Done = 3,
+    Chain = 4
+};
+
+struct JournalRecord {
+    JournalRecordType type;
+    std::uint8_t reserved[3];
+    std::uint32_t label_size; // Только Add и Chain.
+    TimerId id;
+};
+
+struct JournalAddTail {
+    std::int64_t deadline; // Срок: наносекунды system_clock от эпохи.
+    std::int64_t total;    // Длительность в миллисекундах (до версии 3 — в секундах).
+};
+
+struct JournalChainHead {
+    std::uint32_t phase;   // Текущая фаза.
+    std::uint32_t count;
+    std::uint8_t repeat;
+    std::uint8_t reserved[7];
+};
+
+struct JournalPhase {
+    std::int64_t total;    // Как JournalAddTail::total.
+    std::uint32_t label_size;
+    std::uint32_t reserved;
+};
+
+constexpr std::size_t kJournalMinSize = 1 << 20;
+// Журнал после снимка сворачивается, когда он больше снимка и больше этого порога.
+constexpr std::uint64_t kJournalCompactBytes = 1 << 20;
+// Больше номеров слотов TimerTable не выдаёт; id с большим номером — признак порчи.
+constexpr std::uint64_t kJournalMaxSlots = std::uint64_t{ 1 } << 24;
+
+constexpr std::size_t padded(std::size_t n) {
+    return (n + 7) & ~std::size_t{ 7 };
+}
+
+// Раскладка записей — общая для файла и для пачек шардов (JournalBatch).
+std::size_t add_size(std::string_view label) {
+    return sizeof(JournalRecord) + sizeof(JournalAddTail) + padded(label.size());
+}
+
+void put_add(char* p, TimerId id, std::int64_t deadline, std::chrono::milliseconds total, std::string_view label) {
+    JournalRecord rec{};
+    rec.type = JournalRecordType::Add;
+    rec.label_size = static_cast<std::uint32_t>(label.size());
+    rec.id = id;
+    JournalAddTail tail{ deadline, static_cast<std::int64_t>(total.count()) };
+    std::memcpy(p, &rec, sizeof(rec));
+    std::memcpy(p + sizeof(rec), &tail, sizeof(tail));
+    std::memcpy(p + sizeof(rec) + sizeof(tail), label.data(), label.size());
+}
+
+std::size_t chain_payload(const std::vector<TimerSpec>& phases) {
+    std::size_t payload = sizeof(JournalChainHead) + phases.size() * sizeof(JournalPhase);
+    for (const TimerSpec& spec : phases) {
+        payload += spec.label.size();
+    }
+    return payload;
+}
+
+std::size_t chain_size(std::size_t payload) {
+    return sizeof(JournalRecord) + sizeof(JournalAddTail) + padded(payload);
+}
+
+void put_chain(char* p, TimerId id, std::int64_t deadline, const std::vector<TimerSpec>& phases,
+    std::size_t phase, bool repeat, std::size_t payload) {
+    JournalRecord rec{};
+    rec.type = JournalRecordType::Chain;
+    rec.label_size = static_cast<std::uint32_t>(payload);
+    rec.id = id;
+    JournalAddTail tail{ deadline, static_cast<std::int64_t>(phases[phase].duration.count()) };
+    JournalChainHead head{};
+    head.phase = static_cast<std::uint32_t>(phase);
+    head.count = static_cast<std::uint32_t>(phases.size());
+    head.repeat = repeat ? 1 : 0;
+    char* out = p;
+    std::memcpy(out, &rec, sizeof(rec));
+    out += sizeof(rec);
+    std::memcpy(out, &tail, sizeof(tail));
+    out += sizeof(tail);
+    std::memcpy(out, &head, sizeof(head));
+    out += sizeof(head);
+    for (const TimerSpec& spec : phases) {
+        JournalPhase ph{};
+        ph.total = static_cast<std::int64_t>(spec.duration.count());
+        ph.label_size = static_cast<std::uint32_t>(spec.label.size());
+        std::memcpy(out, &ph, sizeof(ph));
+        out += sizeof(ph);
+    }
+    for (const TimerSpec& spec : phases) {
+        std::memcpy(out, spec.label.data(), spec.label.size());
+        out += spec.label.size();
+    }
+}
+
+void put_finish(char* p, JournalRecordType type, TimerId id) {
+    JournalRecord rec{};
+    rec.type = type;
+    rec.id = id;
+    std::memcpy(p, &rec, sizeof(rec));
+}
+
+// Открытый файл журнала, в который дописываются записи.
+struct JournalFile {
+    MappedFile file;
+    std::uint64_t used = 0;
+
+    JournalHeader* header() const { return reinterpret_cast<JournalHeader*>(file.data()); }
+
+    // Создаёт пустой журнал.
+    bool create(const std::string& path) {
+        if (!file.open(path, true) || !file.resize(kJournalMinSize)) {
+            file.close();
+            return false;
+        }
+        JournalHeader h{};
+        std::memcpy(h.magic, kJournalMagic, sizeof(h.magic));
+        h.version = kJournalVersion;
+        std::memcpy(file.data(), &h, sizeof(h));
+        used = 0;
+        return true;
+    }
+
+    // Место под n байт в конце журнала; nullptr — файл не удалось увеличить.
+    char* reserve(std::size_t n) {
+        const std::size_t need = sizeof(JournalHeader) + used + n;
+        if (need > file.size() && !file.resize(std::max(need, file.size() * 2))) {
+            return nullptr;
+        }
+        return file.data() + sizeof(JournalHeader) + used;
+    }
+
+    // Дописывает запись размера size, которую раскладывает put(p).
+    template <class Put>
+    bool append(std::size_t size, Put&& put) {
+        char* p = reserve(size);
+        if (!p) {
+            return false;
+        }
+        put(p);
+        commit(size);
+        return true;
+    }
+
+    // Дописывает уже разложенные записи (JournalBatch::bytes).
+    bool append_bytes(std::string_view bytes) {
+        return append(bytes.size(), [&](char* p) { std::memcpy(p, bytes.data(), bytes.size()); });
+    }
+
+    bool append_add(TimerId id, std::int64_t deadline, std::chrono::milliseconds total, std::string_view label) {
+        return append(add_size(label), [&](char* p) { put_add(p, id, deadline, total, label); });
+    }
+
+    bool append_chain(TimerId id, std::int64_t deadline, const std::vector<TimerSpec>& phases,
+        std::size_t phase, bool repeat) {
+        const std::size_t payload = chain_payload(phases);
+        return append(chain_size(payload), [&](char* p) {
+            put_chain(p, id, deadline, phases, phase, repeat, payload);
+        });
+    }
+
+    void commit(std::size_t size) {
+        used += size;
+        header()->used = used;
+    }
+};
+
+std::uint32_t next_generation(TimerId id) {
+    return static_cast<std::uint32_t>(id >> 32) + 1;
+}
+
+// Состояние журнала. Пишут в него диспетчеры разных шардов, поэтому у журнала свой
+// мьютекс; снимок идёт под мьютексами всех шардов, так что записи между begin и
+// commit не вклиниваются.
+struct Journal {
+    std::mutex mutex;
+    // Журнал открыт для записи: пачкам есть смысл копить записи. Меняется под mutex,
+    // читается без него (journal_add и др. под мьютексом шарда).
+    std::atomic<bool> writable{ false };
+    // Число удачных снимков. Меняется под mutex и под мьютексами всех шардов, поэтому
+    // под мьютексом любого шарда читается согласованно.
+    std::atomic<std::uint64_t> epoch{ 0 };
+    std::string path;
+    JournalFile current;                            // Открытый журнал.
+    JournalFile next;                               // Снимок, который сейчас пишется.
+    std::uint64_t snapshot = 0;                     // Размер снимка в начале current.
+    std::uint32_t generation = 0;                   // Как JournalHeader::generation, для снимка.
+    Clock::time_point anchor_steady;                // Одновременные отсчёты двух часов:
+    std::chrono::system_clock::time_point anchor_wall; // по ним steady-сроки переводятся в абсолютные.
+};
+
+Journal g_journal;
+
+// Якорь задаётся при открытии журнала до запуска потоков, поэтому читается без мьютекса.
+std::int64_t to_wall(Clock::time_point end) {
+    auto wall = g_journal.anchor_wall +
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(end - g_journal.anchor_steady);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(wall.time_since_epoch()).count();
+}
+
+// Журнал не удалось дописать (обычно кончилось место): дальше работаем без него.
+void journal_failed() {
+    g_journal.writable.store(false, std::memory_order_relaxed);
+    g_journal.current.file.close();
+    print_error("journal_write_failed", "Журнал недоступен для записи, таймеры больше не сохраняются.\n");
+}
+
+// Разбирает фазы записи Chain (payload — всё после JournalAddTail). false — запись испорчена.
+bool read_chain(const char* payload, std::size_t size, std::int64_t unit_ms, RecoveredTimer& t) {
+    JournalChainHead head;
+    if (size < sizeof(head)) {
+        return false;
+    }
+    std::memcpy(&head, payload, sizeof(head));
+    if (head.count == 0 || head.phase >= head.count ||
+        (size - sizeof(head)) / sizeof(JournalPhase) < head.count) {
+        return false;
+    }
+    const char* label = payload + sizeof(head) + std::size_t{ head.count } * sizeof(JournalPhase);
+    const char* end = payload + size;
+    t.phases.resize(head.count);
+    for (std::uint32_t i = 0; i < head.count; ++i) {
+        JournalPhase ph;
+        std::memcpy(&ph, payload + sizeof(head) + i * sizeof(JournalPhase), sizeof(ph));
+        if (ph.label_size > static_cast<std::size_t>(end - label)) {
+            return false;
+        }
+        t.phases[i].duration = std::chrono::milliseconds(ph.total * unit_ms);
+        t.phases[i].label.assign(label, ph.label_size);
+        label += ph.label_size;
+    }
+    t.phase = head.phase;
+    t.repeat = head.repeat != 0;
+    t.label = t.phases[head.phase].label;
+    return true;
+}
+
+bool journal_recover(const std::string& path, const std::function<void(RecoveredTimer&)>& restore) {
+    MappedFile file;
+    if (!file.open(path, false) || file.size() == 0) {
+        return true; // Журнала ещё нет.
+    }
+    if (file.size() < sizeof(JournalHeader)) {
+        return false;
+    }
+    JournalHeader h;
+    std::memcpy(&h, file.data(), sizeof(h));
+    if (std::memcmp(h.magic, kJournalMagic, sizeof(h.magic)) != 0 || h.version == 0 || h.version > kJournalVersion) {
+        return false;
+    }
+    std::uint32_t generation = h.generation;
+    const char* begin = file.data() + sizeof(JournalHeader);
+    const std::uint64_t used = std::min<std::uint64_t>(h.used, file.size() - sizeof(JournalHeader));
+    bool intact = used == h.used;
+
+    // Первый проход: для каждого слота каждого шарда — смещение последней записи Add
+    // или Chain + 1, если таймер после неё не завершился. Id однозначны в пределах всего
+    // файла: восстановленные таймеры сохраняют свои id, а новые их не повторяют.
+    std::vector<std::vector<std::uint64_t>> pending_by_shard(kMaxShards);
+    std::uint64_t end = 0;
+    for (std::uint64_t pos = 0; pos + sizeof(JournalRecord) <= used;) {
+        JournalRecord rec;
+        std::memcpy(&rec, begin + pos, sizeof(rec));
+        const std::uint64_t index = (rec.id & kTimerSlotMask) - 1;
+        if ((rec.id & kTimerSlotMask) == 0 || index >= kJournalMaxSlots) {
+            intact = false;
+            break;
+        }
+        // Файлы без generation в заголовке: поколение — по самим записям.
+        generation = std::max(generation, next_generation(rec.id));
+        std::vector<std::uint64_t>& pending = pending_by_shard[shard_of(rec.id)];
+        std::uint64_t size = sizeof(JournalRecord);
+        if (rec.type == JournalRecordType::Add || rec.type == JournalRecordType::Chain) {
+            size += sizeof(JournalAddTail) + padded(rec.label_size);
+            if (pos + size > used) {
+                intact = false;
+                break;
+            }
+            if (index >= pending.size()) {
+                pending.resize(std::max<std::uint64_t>(index + 1, pending.size() * 2));
+            }
+            pending[index] = pos + 1;
+        }
+        else if (rec.type == JournalRecordType::Cancel || rec.type == JournalRecordType::Done) {
+            if (index < pending.size() && pending[index] != 0) {
+                JournalRecord added;
+                std::memcpy(&added, begin + pending[index] - 1, sizeof(added));
+                if (added.id == rec.id) {
+                    pending[index] = 0;
+                }
+            }
+        }
+        else {
+            intact = false;
+            break;
+        }
+        pos += size;
+        end = pos;
+    }
+
+    const std::int64_t unit_ms = h.version < 3 ? 1000 : 1;
+
+    // Второй проход — в порядке записей, чтобы list после перезапуска шёл в прежнем порядке.
+    const auto steady_now = Clock::now();
+    const auto wall_now = std::chrono::system_clock::now();
+    for (std::uint64_t pos = 0; pos < end;) {
+        JournalRecord rec;
+        std::memcpy(&rec, begin + pos, sizeof(rec));
+        std::uint64_t size = sizeof(JournalRecord);
+        if (rec.type == JournalRecordType::Add || rec.type == JournalRecordType::Chain) {
+            size += sizeof(JournalAddTail) + padded(rec.label_size);
+            if (pending_by_shard[shard_of(rec.id)][(rec.id & kTimerSlotMask) - 1] == pos + 1) {
+                JournalAddTail tail;
+                std::memcpy(&tail, begin + pos + sizeof(rec), sizeof(tail));
+                const std::chrono::system_clock::time_point deadline{
+                    std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(tail.deadline)) };
+                RecoveredTimer t;
+                t.id = rec.id;
+                t.end = steady_now + std::chrono::duration_cast<Clock::duration>(deadline - wall_now);
+                t.total = std::chrono::milliseconds(tail.total * unit_ms);
+                const char* payload = begin + pos + sizeof(rec) + sizeof(tail);
+                if (rec.type == JournalRecordType::Add) {
+                    t.label = std::string_view(payload, rec.label_size);
+                }
+                else if (!read_chain(payload, rec.label_size, unit_ms, t)) {
+                    intact = false;
+                    pos += size;
+                    continue;
+                }
+                restore(t);
+            }
+        }
+        pos += size;
+    }
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    g_journal.generation = std::max(g_journal.generation, generation);
+    return intact;
+}
+
+bool journal_open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    JournalFile& current = g_journal.current;
+    if (!current.file.open(path, false) || current.file.size() < sizeof(JournalHeader)) {
+        current.file.close();
+        return false;
+    }
+    g_journal.path = path;
+    g_journal.anchor_steady = Clock::now();
+    g_journal.anchor_wall = std::chrono::system_clock::now();
+    current.used = current.header()->used;
+    g_journal.snapshot = current.header()->snapshot;
+    g_journal.generation = std::max(g_journal.generation, current.header()->generation);
+    current.header()->generation = g_journal.generation;
+    g_journal.writable.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+std::uint32_t journal_generation() {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    return g_journal.generation;
+}
+
+// Учитывает поколение записей пачки в g_journal и в заголовке открытого журнала.
+void note_generation(std::uint32_t generation) {
+    g_journal.generation = std::max(g_journal.generation, generation);
+    if (g_journal.current.file.is_open()) {
+        g_journal.current.header()->generation = g_journal.generation;
+    }
+}
+
+bool journal_begin_snapshot(const std::string& path) {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    if (!g_journal.current.file.is_open()) {
+        g_journal.anchor_steady = Clock::now();
+        g_journal.anchor_wall = std::chrono::system_clock::now();
+    }
+    g_journal.path = path;
+    return g_journal.next.create(path + ".tmp");
+}
+
+void journal_snapshot_add(TimerId id, Clock::time_point end, std::chrono::milliseconds total, std::string_view label) {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    if (g_journal.next.file.is_open() && !g_journal.next.append_add(id, to_wall(end), total, label)) {
+        g_journal.next.file.close();
+    }
+}
+
+void journal_snapshot_add_chain(TimerId id, Clock::time_point end, const std::vector<TimerSpec>& phases,
+    std::size_t phase, bool repeat) {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    if (g_journal.next.file.is_open() && !g_journal.next.append_chain(id, to_wall(end), phases, phase, repeat)) {
+        g_journal.next.file.close();
+    }
+}
+
+bool journal_commit_snapshot() {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    JournalFile& next = g_journal.next;
+    if (!next.file.is_open()) {
+        return false;
+    }
+    next.header()->snapshot = next.used;
+    next.header()->generation = g_journal.generation;
+    const std::uint64_t used = next.used;
+    next.file.flush();
+    next.file.close();
+
+    // Windows не даёт подменить открытый файл, поэтому старый журнал закрываем до подмены.
+    g_journal.current.file.close();
+    const std::string tmp = g_journal.path + ".tmp";
+    if (!replace_file(tmp, g_journal.path)) {
+        std::remove(tmp.c_str());
+        // Остаёмся на прежнем журнале: он цел, просто не свёрнут.
+        if (!g_journal.current.file.open(g_journal.path, false)) {
+            journal_failed();
+        }
+        return false;
+    }
+    if (!g_journal.current.file.open(g_journal.path, false)) {
+        journal_failed();
+        return false;
+    }
+    g_journal.current.used = used;
+    g_journal.snapshot = used;
+    g_journal.epoch.fetch_add(1, std::memory_order_relaxed);
+    g_journal.writable.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+bool journal_is_open() {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    return g_journal.current.file.is_open();
+}
+
+// Место под n байт в конце пачки.
+char* batch_reserve(JournalBatch& batch, std::size_t n) {
+    const std::size_t used = batch.bytes.size();
+    batch.bytes.resize(used + n);
+    return batch.bytes.data() + used;
+}
+
+void journal_add(JournalBatch& batch, TimerId id, Clock::time_point end, std::chrono::milliseconds total,
+    std::string_view label) {
+    if (!g_journal.writable.load(std::memory_order_relaxed)) {
+        return;
+    }
+    put_add(batch_reserve(batch, add_size(label)), id, to_wall(end), total, label);
+    batch.generation = std::max(batch.generation, next_generation(id));
+}
+
+void journal_add_chain(JournalBatch& batch, TimerId id, Clock::time_point end, const std::vector<TimerSpec>& phases,
+    std::size_t phase, bool repeat) {
+    if (!g_journal.writable.load(std::memory_order_relaxed)) {
+        return;
+    }
+    const std::size_t payload = chain_payload(phases);
+    put_chain(batch_reserve(batch, chain_size(payload)), id, to_wall(end), phases, phase, repeat, payload);
+    batch.generation = std::max(batch.generation, next_generation(id));
+}
+
+void journal_cancel(JournalBatch& batch, TimerId id) {
+    if (g_journal.writable.load(std::memory_order_relaxed)) {
+        put_finish(batch_reserve(batch, sizeof(JournalRecord)), JournalRecordType::Cancel, id);
+    }
+}
+
+void journal_done(JournalBatch& batch, TimerId id) {
+    if (g_journal.writable.load(std::memory_order_relaxed)) {
+        put_finish(batch_reserve(batch, sizeof(JournalRecord)), JournalRecordType::Done, id);
+    }
+}
+
+std::uint64_t journal_epoch() {
+    return g_journal.epoch.load(std::memory_order_relaxed);
+}
+
+void journal_write(JournalBatch& batch) {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    if (batch.epoch == journal_epoch() && g_journal.current.file.is_open() &&
+        !g_journal.current.append_bytes(batch.bytes)) {
+        journal_failed();
+    }
+    // Поколение учитываем и у отброшенной пачки: её id могли уже завершиться.
+    note_generation(batch.generation);
+    batch.clear();
+}
+
+void journal_discard(JournalBatch& batch) {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    note_generation(batch.generation);
+    batch.clear();
+}
+
+bool journal_needs_compaction() {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    if (!g_journal.current.file.is_open()) {
+        return false;
+    }
+    const std::uint64_t tail = g_journal.current.used - g_journal.snapshot;
+    return tail > kJournalCompactBytes && tail > g_journal.snapshot;
+}
+
+void journal_close() {
+    std::lock_guard<std::mutex> lock(g_journal.mutex);
+    g_journal.writable.store(false, std::memory_order_relaxed);
+    g_journal.current.file.flush();
+    g_journal.current.file.close();
+}
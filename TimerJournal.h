@@ -0,0 +1,93 @@
+﻿#pragma once
+
+// Журнал таймеров (--journal=<файл>): отображённый в память файл, куда дописываются
+// двоичные записи add/cancel/done. Сроки хранятся по system_clock (якорь пары
+// steady/system берётся при открытии), поэтому после перезапуска ожидающие таймеры
+// восстанавливаются с прежними абсолютными сроками и прежними id.
+// Файл начинается со снимка (по записи на каждый ожидающий таймер), дальше — журнал
+// изменений после снимка; разросшийся журнал сворачивается в новый снимок.
+// Внутренний заголовок движка (TimerEngine.cpp). Потокобезопасен (свой мьютекс);
+// снимок (begin ... commit) — под мьютексами всех шардов.
+// Записи add/cancel/done шард копит в своей пачке (JournalBatch) под своим мьютексом,
+// а в файл переносит journal_write уже без него: иначе все шарды ждали бы друг друга
+// на мьютексе журнала.
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+#include "TimerEngine.h"
+
+// Записи журнала одного шарда, ещё не перенесённые в файл.
+struct JournalBatch {
+    std::string bytes;            // Записи подряд в формате файла.
+    std::uint32_t generation = 0; // Наибольшее поколение, которое надо учесть за id пачки.
+    std::uint64_t epoch = 0;      // journal_epoch(), когда пачку забрали из шарда.
+
+    bool empty() const { return bytes.empty(); }
+    void clear() {
+        bytes.clear();
+        generation = 0;
+    }
+};
+
+struct RecoveredTimer {
+    TimerId id;                  // Прежний id: восстановленный таймер сохраняет его.
+    Clock::time_point end;       // Прежний срок в текущем steady_clock (может быть уже в прошлом).
+    std::chrono::milliseconds total{ 0 };
+    std::string_view label;      // Указывает в отображение файла; действителен только в restore.
+    // Цепочка (add_chain): все фазы и номер текущей, end/total/label — её. Пусто — обычный таймер.
+    std::vector<TimerSpec> phases;
+    std::size_t phase = 0;
+    bool repeat = false;
+};
+
+// Читает журнал и вызывает restore для каждого таймера, который не сработал и не был
+// отменён, в порядке записей. Отсутствующий файл — не ошибка. false — файл повреждён:
+// прочитанное до повреждения восстановлено, но дописывать такой файл нельзя.
+bool journal_recover(const std::string& path, const std::function<void(RecoveredTimer&)>& restore);
+
+// Открывает для дописывания целый журнал, уже прочитанный journal_recover.
+bool journal_open(const std::string& path);
+
+// Больше поколения любого id, когда-либо записанного в журнал (после journal_recover).
+// Новые id после перезапуска берут поколение не меньше его, иначе id таймеров,
+// завершившихся в прошлом запуске, достались бы новым и чужой cancel отменил бы их.
+std::uint32_t journal_generation();
+
+// Снимок: begin, по add на каждый ожидающий таймер, commit. Снимок пишется во
+// временный файл и атомарно заменяет журнал; после commit журнал открыт для записи.
+// Если журнала нет или он повреждён, первый снимок при запуске создаёт его заново.
+bool journal_begin_snapshot(const std::string& path);
+void journal_snapshot_add(TimerId id, Clock::time_point end, std::chrono::milliseconds total, std::string_view label);
+void journal_snapshot_add_chain(TimerId id, Clock::time_point end, const std::vector<TimerSpec>& phases,
+    std::size_t phase, bool repeat);
+bool journal_commit_snapshot();
+
+bool journal_is_open();
+
+// Записи в пачку шарда; мьютекс журнала не берут. Пока журнал закрыт, ничего не пишут.
+void journal_add(JournalBatch& batch, TimerId id, Clock::time_point end, std::chrono::milliseconds total,
+    std::string_view label);
+// Цепочка целиком; дописывается при создании и при каждом перевзводе (end — срок фазы phase).
+void journal_add_chain(JournalBatch& batch, TimerId id, Clock::time_point end, const std::vector<TimerSpec>& phases,
+    std::size_t phase, bool repeat);
+void journal_cancel(JournalBatch& batch, TimerId id);
+void journal_done(JournalBatch& batch, TimerId id);
+
+// Число удачных снимков; для JournalBatch::epoch. Читать под мьютексом шарда.
+std::uint64_t journal_epoch();
+// Дописывает пачку в журнал и очищает её. Пачку, забранную до последнего снимка,
+// отбрасывает: снимок уже учёл её записи. Пачки одного шарда — строго по очереди.
+void journal_write(JournalBatch& batch);
+// Очищает пачку, записи которой учёл снимок (после journal_commit_snapshot).
+void journal_discard(JournalBatch& batch);
+
+// Записей после снимка уже больше, чем в нём самом (и больше порога) — пора сворачивать.
+bool journal_needs_compaction();
+
+// Сбрасывает отображение на диск и закрывает журнал.
+void journal_close();
@@ -0,0 +1,146 @@
+﻿#include "TimerLabels.h"
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+
+#ifdef _WIN32
+#pragma execution_character_set("utf-8")
+#endif
+
+constexpr std::size_t kLabelClasses = 4;         // Блоки 32, 64, 128 и 256 байт.
+constexpr std::size_t kMinBlockBits = 5;
+constexpr std::size_t kLabelPageBytes = 64 * 1024;
+constexpr std::uint32_t kMaxLabelPages = 4096;   // На класс: до 256 МБ меток.
+constexpr int kClassShift = 28;
+constexpr std::uint32_t kIndexMask = (std::uint32_t{ 1 } << kClassShift) - 1;
+
+// Страница блоков одного класса. Ссылки стека свободных — в отдельном массиве,
+// а не в самих блоках: take_block читает ссылку блока, который в это время
+// может уже заполнять новый владелец.
+struct LabelPage {
+    std::unique_ptr<std::atomic<std::uint32_t>[]> next_free;
+    std::unique_ptr<char[]> data;
+};
+
+// Класс блоков: каталог страниц (никогда не перевыделяется, как у TimerTable) и стек
+// свободных Трайбера, счётчик в старших битах головы защищает от ABA.
+struct LabelClass {
+    std::atomic<LabelPage*> pages[kMaxLabelPages] = {};
+    std::atomic<std::uint64_t> free_head{ 0 };   // (счётчик << 32) | (номер + 1).
+    std::atomic<std::uint32_t> next_fresh{ 0 };  // Первый ни разу не выданный номер.
+};
+
+// Страницы не освобождаются: к выходу метки может ещё держать статическая таблица шарда.
+LabelClass g_label_classes[kLabelClasses];
+
+constexpr std::size_t block_size(std::size_t cls) {
+    return std::size_t{ 1 } << (kMinBlockBits + cls);
+}
+
+constexpr std::size_t blocks_per_page(std::size_t cls) {
+    return kLabelPageBytes / block_size(cls);
+}
+
+std::size_t class_of(std::size_t size) {
+    std::size_t cls = 0;
+    while (block_size(cls) < size) {
+        ++cls;
+    }
+    return cls;
+}
+
+LabelPage* page_of(std::size_t cls, std::uint32_t index) {
+    return g_label_classes[cls].pages[index / blocks_per_page(cls)].load(std::memory_order_acquire);
+}
+
+std::atomic<std::uint32_t>& next_free_of(std::size_t cls, std::uint32_t index) {
+    return page_of(cls, index)->next_free[index % blocks_per_page(cls)];
+}
+
+char* block_data(std::size_t cls, std::uint32_t index) {
+    return page_of(cls, index)->data.get() + (index % blocks_per_page(cls)) * block_size(cls);
+}
+
+// Номер свободного блока класса + 1; 0 — пул класса исчерпан.
+std::uint32_t take_block(std::size_t cls) {
+    LabelClass& c = g_label_classes[cls];
+    std::uint64_t head = c.free_head.load(std::memory_order_acquire);
+    while ((head & 0xFFFFFFFFu) != 0) {
+        const auto index = static_cast<std::uint32_t>((head & 0xFFFFFFFFu) - 1);
+        const std::uint64_t next = (((head >> 32) + 1) << 32) | next_free_of(cls, index).load(std::memory_order_relaxed);
+        if (c.free_head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+            return index + 1;
+        }
+    }
+
+    const std::uint32_t index = c.next_fresh.fetch_add(1, std::memory_order_relaxed);
+    const std::size_t page = index / blocks_per_page(cls);
+    if (page >= kMaxLabelPages || index >= kIndexMask) {
+        return 0;
+    }
+    if (!c.pages[page].load(std::memory_order_acquire)) {
+        // Первый блок страницы может достаться нескольким потокам сразу: ставит победитель CAS.
+        auto fresh = std::make_unique<LabelPage>();
+        fresh->next_free = std::make_unique<std::atomic<std::uint32_t>[]>(blocks_per_page(cls));
+        fresh->data = std::make_unique<char[]>(kLabelPageBytes);
+        LabelPage* expected = nullptr;
+        if (c.pages[page].compare_exchange_strong(expected, fresh.get(), std::memory_order_acq_rel)) {
+            fresh.release();
+        }
+    }
+    return index + 1;
+}
+
+void return_block(std::size_t cls, std::uint32_t index) {
+    LabelClass& c = g_label_classes[cls];
+    std::atomic<std::uint32_t>& link = next_free_of(cls, index);
+    std::uint64_t head = c.free_head.load(std::memory_order_relaxed);
+    std::uint64_t next;
+    do {
+        link.store(static_cast<std::uint32_t>(head & 0xFFFFFFFFu), std::memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | (static_cast<std::uint64_t>(index) + 1);
+    } while (!c.free_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
+PooledLabel::PooledLabel(std::string_view text) : size_(static_cast<std::uint32_t>(text.size())) {
+    if (text.size() <= kInlineLabel) {
+        std::memcpy(inline_, text.data(), text.size());
+        return;
+    }
+    data_ = nullptr;
+    if (text.size() <= kMaxPooledLabel) {
+        const std::size_t cls = class_of(text.size());
+        if (const std::uint32_t block = take_block(cls)) {
+            block_ = static_cast<std::uint32_t>(cls << kClassShift) | block;
+            data_ = block_data(cls, block - 1);
+        }
+    }
+    if (!data_) {
+        data_ = new char[text.size()];
+    }
+    std::memcpy(data_, text.data(), text.size());
+}
+
+PooledLabel& PooledLabel::operator=(PooledLabel&& other) noexcept {
+    if (this != &other) {
+        release();
+        std::memcpy(inline_, other.inline_, kInlineLabel);
+        size_ = other.size_;
+        block_ = other.block_;
+        other.size_ = 0;
+        other.block_ = 0;
+    }
+    return *this;
+}
+
+void PooledLabel::release() {
+    if (block_ != 0) {
+        return_block(block_ >> kClassShift, (block_ & kIndexMask) - 1);
+    }
+    else if (size_ > kInlineLabel) {
+        delete[] data_;
+    }
+    size_ = 0;
+    block_ = 0;
+}
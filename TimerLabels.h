@@ -0,0 +1,50 @@
+﻿#pragma once
+
+// Метки таймеров. Короткая (до kInlineLabel байт) хранится прямо в PooledLabel,
+// длиннее — в общем пуле блоков. Метка копируется в блок своего класса
+// (32, 64, 128 или 256 байт), освобождённый блок уходит в стек свободных своего
+// класса и достаётся следующей метке, так что в установившемся режиме add_timer
+// и срабатывание аллокатор не зовут. Страницы пула живут до выхода: пул держит
+// столько блоков, сколько меток было живо одновременно. Метки длиннее
+// kMaxPooledLabel (и сверх ёмкости пула) берутся из кучи.
+// Выделение и возврат — без блокировок, из любого потока.
+// Внутренний заголовок движка (TimerEngine.cpp).
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+constexpr std::size_t kInlineLabel = 16;
+constexpr std::size_t kMaxPooledLabel = 256;
+
+// Владеющая копия метки. Только перемещается; метка до kInlineLabel байт блока не занимает.
+class PooledLabel {
+public:
+    PooledLabel() = default;
+    explicit PooledLabel(std::string_view text);
+    ~PooledLabel() { release(); }
+
+    PooledLabel(PooledLabel&& other) noexcept : size_(other.size_), block_(other.block_) {
+        std::memcpy(inline_, other.inline_, kInlineLabel); // Вместе с data_, если она не встроена.
+        other.size_ = 0;
+        other.block_ = 0;
+    }
+    PooledLabel& operator=(PooledLabel&& other) noexcept;
+    PooledLabel(const PooledLabel&) = delete;
+    PooledLabel& operator=(const PooledLabel&) = delete;
+
+    std::string_view view() const { return { size_ <= kInlineLabel ? inline_ : data_, size_ }; }
+    operator std::string_view() const { return view(); }
+    bool empty() const { return size_ == 0; }
+
+private:
+    void release();
+
+    union {
+        char* data_;                   // size_ > kInlineLabel: блок пула или куча.
+        char inline_[kInlineLabel] = {};
+    };
+    std::uint32_t size_ = 0;
+    std::uint32_t block_ = 0; // (класс << 28) | (номер блока + 1); 0 — куча, встроенная или пусто.
+};
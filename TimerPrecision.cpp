@@ -0,0 +1,188 @@
+﻿#include "TimerPrecision.h"
+
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX // Иначе макросы min/max из windows.h ломают std::min/std::max.
+#include <windows.h>
+#include <timeapi.h>
+#pragma comment(lib, "winmm.lib")
+#pragma execution_character_set("utf-8")
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002 // Windows 10 1803+.
+#endif
+#else
+#include <cerrno>
+#include <cstdint>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Хвост перед сроком, который досыпается вращением: столько в худшем случае
+// опаздывает пробуждение высокоточного таймера ОС.
+#ifdef _WIN32
+constexpr Clock::duration kSpinTail = std::chrono::microseconds(500);
+#else
+constexpr Clock::duration kSpinTail = std::chrono::microseconds(60);
+#endif
+
+#ifdef _WIN32
+
+void precision_begin() {
+    timeBeginPeriod(1);
+}
+
+void precision_end() {
+    timeEndPeriod(1);
+}
+
+// Свой таймер у каждого ждущего потока; закрывается при выходе потока.
+struct PreciseTimer {
+    HANDLE handle;
+
+    PreciseTimer() {
+        handle = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (!handle) {
+            // Старая Windows: обычный таймер, он точен до кванта из timeBeginPeriod.
+            handle = CreateWaitableTimerW(nullptr, TRUE, nullptr);
+        }
+    }
+    ~PreciseTimer() {
+        if (handle) CloseHandle(handle);
+    }
+};
+
+void sleep_os_until(Clock::time_point until) {
+    const auto left = until - Clock::now();
+    if (left <= Clock::duration::zero()) {
+        return;
+    }
+    thread_local PreciseTimer timer;
+    // Отрицательный срок — относительный, в единицах по 100 нс.
+    LARGE_INTEGER due;
+    due.QuadPart = -static_cast<LONGLONG>(std::chrono::duration_cast<std::chrono::nanoseconds>(left).count() / 100);
+    if (timer.handle && SetWaitableTimer(timer.handle, &due, 0, nullptr, nullptr, FALSE)) {
+        WaitForSingleObject(timer.handle, INFINITE);
+    }
+}
+
+IdleTimer::IdleTimer()
+    : event_(CreateEventW(nullptr, FALSE, FALSE, nullptr)),
+      // Без CREATE_WAITABLE_TIMER_HIGH_RESOLUTION: высокоточный таймер допуск не сводит.
+      timer_(CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS)) {
+}
+
+IdleTimer::~IdleTimer() {
+    if (timer_) CloseHandle(timer_);
+    if (event_) CloseHandle(event_);
+}
+
+void IdleTimer::notify() {
+    SetEvent(event_);
+}
+
+bool IdleTimer::wait_until(Clock::time_point deadline, Clock::duration tolerance) {
+    if (deadline == Clock::time_point::max() || !timer_) {
+        WaitForSingleObject(event_, INFINITE);
+        return true;
+    }
+    const auto left = deadline - Clock::now();
+    if (left <= Clock::duration::zero()) {
+        return WaitForSingleObject(event_, 0) == WAIT_OBJECT_0;
+    }
+    LARGE_INTEGER due;
+    due.QuadPart = -static_cast<LONGLONG>(std::chrono::duration_cast<std::chrono::nanoseconds>(left).count() / 100);
+    const auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(tolerance).count();
+    if (!SetWaitableTimerEx(timer_, &due, 0, nullptr, nullptr, nullptr, static_cast<ULONG>(delay))) {
+        return WaitForSingleObject(event_, static_cast<DWORD>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1)) == WAIT_OBJECT_0;
+    }
+    HANDLE handles[2] = { event_, timer_ };
+    if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0) {
+        CancelWaitableTimer(timer_);
+        return true;
+    }
+    return false;
+}
+
+#else
+
+void precision_begin() {
+}
+
+void precision_end() {
+}
+
+// Clock (steady_clock) в libstdc++ и libc++ на Linux идёт по CLOCK_MONOTONIC,
+// поэтому срок передаётся ядру как абсолютный, без пересчёта от now.
+void sleep_os_until(Clock::time_point until) {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(until.time_since_epoch()).count();
+    if (ns <= 0) {
+        return;
+    }
+    timespec ts;
+    ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+}
+
+IdleTimer::IdleTimer() : event_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+}
+
+IdleTimer::~IdleTimer() {
+    if (event_fd_ >= 0) close(event_fd_);
+}
+
+void IdleTimer::notify() {
+    const std::uint64_t one = 1;
+    while (write(event_fd_, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+// timerfd для этого не годится: его срок ядро взводит без timer slack. Зато slack
+// потока соблюдает таймаут ppoll, поэтому срок ждётся им, а notify() — через eventfd.
+bool IdleTimer::wait_until(Clock::time_point deadline, Clock::duration tolerance) {
+    // Slack — свойство потока; ставим, только когда он меняется.
+    thread_local long long thread_slack = -1;
+    const long long slack = std::chrono::duration_cast<std::chrono::nanoseconds>(tolerance).count();
+    if (slack > 0 && slack != thread_slack && prctl(PR_SET_TIMERSLACK, static_cast<unsigned long>(slack)) == 0) {
+        thread_slack = slack;
+    }
+
+    pollfd fd{ event_fd_, POLLIN, 0 };
+    for (;;) {
+        timespec left{};
+        timespec* timeout = nullptr;
+        if (deadline != Clock::time_point::max()) {
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count();
+            if (ns > 0) {
+                left.tv_sec = static_cast<time_t>(ns / 1000000000);
+                left.tv_nsec = static_cast<long>(ns % 1000000000);
+            }
+            timeout = &left;
+        }
+        const int ready = ppoll(&fd, 1, timeout, nullptr);
+        if (ready > 0) {
+            std::uint64_t count;
+            while (read(event_fd_, &count, sizeof(count)) < 0 && errno == EINTR) {
+            }
+            return true;
+        }
+        if (ready == 0 || errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+#endif
+
+void sleep_until_precise(Clock::time_point deadline) {
+    sleep_os_until(deadline - kSpinTail);
+    while (Clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+}
@@ -0,0 +1,54 @@
+﻿#pragma once
+
+// Ожидания на таймерах ОС. Точное — для высокоточного режима (--hires): обычные
+// ожидания (семафор, condition_variable) ОС будит с точностью своего кванта таймера,
+// на Windows это по умолчанию 15.6 мс, поэтому последний отрезок до срока движок в
+// --hires ждёт здесь. Экономное — для --power-save (IdleTimer).
+// Внутренний заголовок движка (TimerEngine.cpp).
+
+#include <chrono>
+
+#include "TimerEngine.h"
+
+// Последние столько до срока ждутся через sleep_until_precise.
+#ifdef _WIN32
+constexpr Clock::duration kPreciseWindow = std::chrono::milliseconds(2);
+#else
+constexpr Clock::duration kPreciseWindow = std::chrono::microseconds(250);
+#endif
+
+// Квант системного таймера 1 мс на время работы движка (Windows: timeBeginPeriod).
+// На Linux квант и так мелкий, и функции ничего не делают.
+void precision_begin();
+void precision_end();
+
+// Спит до deadline на высокоточном таймере ОС (Windows: waitable timer с
+// CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, Linux: clock_nanosleep по CLOCK_MONOTONIC),
+// последние микросекунды добирает вращением. Прервать такой сон нельзя.
+void sleep_until_precise(Clock::time_point deadline);
+
+// Ожидание срока или notify() на объектах ОС, которым разрешено опоздать на tolerance,
+// чтобы ОС свела пробуждение с соседними таймерами (свои и чужих процессов) и не будила
+// процессор ради каждого. Windows: coalescable waitable timer (SetWaitableTimerEx
+// с TolerableDelay) и событие; Linux: eventfd и ppoll с timer slack потока
+// (PR_SET_TIMERSLACK). Без срока (max()) ждёт только notify(), таймер не взводит.
+// Ждать может один поток, notify() — из любого; notify() до ожидания не теряется.
+class IdleTimer {
+public:
+    IdleTimer();
+    ~IdleTimer();
+    IdleTimer(const IdleTimer&) = delete;
+    IdleTimer& operator=(const IdleTimer&) = delete;
+
+    void notify();
+    // true — был notify(), false — наступил срок.
+    bool wait_until(Clock::time_point deadline, Clock::duration tolerance);
+
+private:
+#ifdef _WIN32
+    void* event_;  // HANDLE: событие с автосбросом для notify().
+    void* timer_;  // HANDLE: waitable timer с автосбросом.
+#else
+    int event_fd_;
+#endif
+};
@@ -0,0 +1,232 @@
+﻿#pragma once
+
+// Очереди сроков: иерархическое колесо и куча. Шаблоны по типу момента времени,
+// чтобы ими пользовались и движок (Clock), и TimerService с любой политикой часов.
+// Очередь хранит только id и сроки; отменённые таймеры остаются в ней до срока,
+// владелец отбрасывает их сам при срабатывании.
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "TimerEngine.h"
+
+// Иерархическое колесо таймеров (Varghese & Lauck, как таймеры ядра Linux).
+// kLevels уровней по kSlots слотов; слот уровня l покрывает 64^l тиков.
+// Таймер кладётся на самый нижний уровень, куда помещается его срок, и по мере
+// продвижения времени каскадом спускается вниз, пока не сработает на уровне 0.
+// Вставка O(1), продвижение — O(сработавших + перенесённых) без перебора пустых тиков.
+// Не потокобезопасно: все вызовы — под мьютексом владельца (у движка — шарда).
+template <class TimePoint>
+class BasicTimingWheel {
+public:
+    using Duration = typename TimePoint::duration;
+
+    static constexpr int kLevelBits = 6;
+    static constexpr int kSlots = 1 << kLevelBits;
+    static constexpr int kLevels = 6;                       // 64^6 тиков по 10 мс ≈ 21 год.
+    static constexpr std::chrono::milliseconds kTick{ 10 };
+    static constexpr std::chrono::milliseconds kHiresTick{ 1 }; // --hires: 64^6 тиков ≈ 2 года.
+
+    explicit BasicTimingWheel(TimePoint epoch) : epoch_(epoch) {}
+
+    // Начинает отсчёт заново с другим тиком. Только для пустого колеса.
+    void reset(TimePoint epoch, Duration tick) {
+        epoch_ = epoch;
+        tick_ = tick;
+        now_ = 0;
+    }
+
+    Duration tick() const { return tick_; }
+
+    // Добавляет таймер id, срабатывающий не раньше end.
+    void insert(TimerId id, TimePoint end) {
+        std::uint64_t expire = ceil_tick(end);
+        if (expire <= now_) {
+            expire = now_ + 1; // Текущий тик уже обработан — сработает на следующем.
+        }
+        place(Entry{ id, expire });
+        ++size_;
+    }
+
+    // Продвигает колесо до момента now и дописывает в fired id сработавших таймеров.
+    void advance(TimePoint now, std::vector<TimerId>& fired) {
+        if (now < epoch_) {
+            return;
+        }
+        const std::uint64_t target = static_cast<std::uint64_t>((now - epoch_) / tick_);
+        while (true) {
+            std::uint64_t next = next_event_tick();
+            if (next > target) {
+                // До target колесу делать нечего — перескакиваем пустые тики разом.
+                if (target > now_) now_ = target;
+                return;
+            }
+            now_ = next;
+            process_tick(fired);
+        }
+    }
+
+    // Момент, к которому колесу снова будет что делать (срабатывание или каскад).
+    TimePoint next_deadline() const {
+        std::uint64_t next = next_event_tick();
+        if (next == UINT64_MAX) {
+            return TimePoint::max();
+        }
+        return epoch_ + tick_ * static_cast<typename Duration::rep>(next);
+    }
+
+    std::size_t size() const { return size_; }
+
+private:
+    struct Entry {
+        TimerId id;           // Таймер в таблице владельца.
+        std::uint64_t expire; // Тик срабатывания.
+    };
+
+    std::uint64_t ceil_tick(TimePoint tp) const {
+        if (tp <= epoch_) {
+            return 0;
+        }
+        auto d = tp - epoch_;
+        auto ticks = static_cast<std::uint64_t>(d / tick_);
+        if (d % tick_ != Duration::zero()) {
+            ++ticks;
+        }
+        return ticks;
+    }
+
+    // Кладёт запись в слот относительно текущего тика now_ (expire >= now_).
+    void place(const Entry& e) {
+        const std::uint64_t delta = e.expire - now_;
+        for (int level = 0; level < kLevels; ++level) {
+            const int shift = level * kLevelBits;
+            if (level == kLevels - 1 || delta < (std::uint64_t{ 1 } << (shift + kLevelBits))) {
+                std::uint64_t at = e.expire;
+                if (level == kLevels - 1 && delta >= (std::uint64_t{ 1 } << (shift + kLevelBits))) {
+                    // Дальше горизонта колеса: ставим на самый дальний слот,
+                    // при каскаде запись будет переложена заново.
+                    at = now_ + (std::uint64_t{ 1 } << (shift + kLevelBits)) - 1;
+                }
+                const int slot = static_cast<int>((at >> shift) & (kSlots - 1));
+                slots_[level][slot].push_back(e);
+                occupied_[level] |= std::uint64_t{ 1 } << slot;
+                return;
+            }
+        }
+    }
+
+    // Обрабатывает тик now_: спускает вниз записи верхних уровней, чья граница
+    // наступила (сверху вниз), затем забирает сработавшие с уровня 0.
+    void process_tick(std::vector<TimerId>& fired) {
+        for (int level = kLevels - 1; level >= 1; --level) {
+            const int shift = level * kLevelBits;
+            if ((now_ & ((std::uint64_t{ 1 } << shift) - 1)) != 0) {
+                continue;
+            }
+            const int slot = static_cast<int>((now_ >> shift) & (kSlots - 1));
+            if (!(occupied_[level] & (std::uint64_t{ 1 } << slot))) {
+                continue;
+            }
+            // Обмен с scratch_, а не с новым вектором: ёмкость остаётся в колесе.
+            scratch_.swap(slots_[level][slot]);
+            occupied_[level] &= ~(std::uint64_t{ 1 } << slot);
+            for (const auto& e : scratch_) {
+                place(e);
+            }
+            scratch_.clear();
+        }
+
+        const int slot = static_cast<int>(now_ & (kSlots - 1));
+        if (!(occupied_[0] & (std::uint64_t{ 1 } << slot))) {
+            return;
+        }
+        scratch_.swap(slots_[0][slot]);
+        occupied_[0] &= ~(std::uint64_t{ 1 } << slot);
+        for (const auto& e : scratch_) {
+            fired.push_back(e.id);
+        }
+        size_ -= scratch_.size();
+        scratch_.clear();
+    }
+
+    // Ближайший тик после now_, на котором обрабатывается хоть один занятый слот.
+    std::uint64_t next_event_tick() const {
+        if (size_ == 0) {
+            return UINT64_MAX;
+        }
+        std::uint64_t best = UINT64_MAX;
+        for (int level = 0; level < kLevels; ++level) {
+            const std::uint64_t mask = occupied_[level];
+            if (mask == 0) {
+                continue;
+            }
+            const int shift = level * kLevelBits;
+            const int pos = static_cast<int>((now_ >> shift) & (kSlots - 1));
+            const std::uint64_t base = (now_ >> (shift + kLevelBits)) << (shift + kLevelBits);
+            // Слоты правее текущей позиции — в этом обороте уровня, остальные — в следующем.
+            const std::uint64_t ahead = mask & ~((std::uint64_t{ 2 } << pos) - 1);
+            std::uint64_t tick;
+            if (ahead != 0) {
+                tick = base + (static_cast<std::uint64_t>(std::countr_zero(ahead)) << shift);
+            }
+            else {
+                tick = base + (std::uint64_t{ 1 } << (shift + kLevelBits)) +
+                    (static_cast<std::uint64_t>(std::countr_zero(mask)) << shift);
+            }
+            if (tick < best) best = tick;
+        }
+        return best;
+    }
+
+    TimePoint epoch_;
+    Duration tick_ = kTick;
+    std::uint64_t now_ = 0;                  // Последний обработанный тик.
+    std::size_t size_ = 0;                   // Записей в колесе (включая отменённые).
+    std::uint64_t occupied_[kLevels] = {};  // Битовые маски непустых слотов.
+    std::vector<Entry> slots_[kLevels][kSlots];
+    std::vector<Entry> scratch_;             // Разбираемый слот; пуст вне process_tick.
+};
+
+// Куча сроков (EngineKind::Heap) с тем же интерфейсом, что у BasicTimingWheel.
+// Сроки точные, без округления до тика, поэтому next_deadline — ровно ближайший срок,
+// и пустых пробуждений ради каскадов, как у колеса, нет. Вставка и извлечение — O(log n).
+// Отменённые таймеры, как и в колесе, остаются в куче до своего срока.
+template <class TimePoint>
+class BasicTimerHeap {
+public:
+    // Эпоха не нужна: параметр — для единообразия с колесом.
+    explicit BasicTimerHeap(TimePoint = {}) {}
+
+    void insert(TimerId id, TimePoint end) {
+        entries_.push_back(Entry{ end, id });
+        std::push_heap(entries_.begin(), entries_.end(), later);
+    }
+
+    // Забирает в fired id всех таймеров со сроком не позже now.
+    void advance(TimePoint now, std::vector<TimerId>& fired) {
+        while (!entries_.empty() && entries_.front().end <= now) {
+            fired.push_back(entries_.front().id);
+            std::pop_heap(entries_.begin(), entries_.end(), later);
+            entries_.pop_back();
+        }
+    }
+
+    TimePoint next_deadline() const {
+        return entries_.empty() ? TimePoint::max() : entries_.front().end;
+    }
+
+    std::size_t size() const { return entries_.size(); }
+
+private:
+    struct Entry {
+        TimePoint end;
+        TimerId id;
+    };
+
+    static bool later(const Entry& a, const Entry& b) { return a.end > b.end; }
+
+    std::vector<Entry> entries_; // Куча по end: ближайший — в front.
+};
@@ -0,0 +1,183 @@
+﻿#include "TimerReplay.h"
+#include "TimerService.h"
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+#ifdef _WIN32
+#pragma execution_character_set("utf-8")
+#endif
+
+// Команды пишут в трассу и из цикла ввода, и из потоков сервера (--listen): строки
+// под одной блокировкой, а время берётся под ней же — at в файле не убывает.
+std::mutex g_trace_mutex;
+std::ofstream g_trace;
+Clock::time_point g_trace_start;
+
+bool trace_open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    g_trace.open(path, std::ios::trunc);
+    g_trace_start = Clock::now();
+    return static_cast<bool>(g_trace);
+}
+
+std::chrono::milliseconds::rep trace_now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - g_trace_start).count();
+}
+
+void trace_add(TimerId id, std::chrono::milliseconds duration) {
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    if (g_trace.is_open() && id != kInvalidTimer) {
+        g_trace << trace_now() << " add " << id << ' ' << duration.count() << '\n';
+    }
+}
+
+void trace_cancel(TimerId id) {
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    if (g_trace.is_open()) {
+        g_trace << trace_now() << " cancel " << id << '\n';
+    }
+}
+
+void trace_close() {
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    if (g_trace.is_open()) {
+        g_trace.close();
+    }
+}
+
+// Следующее поле строки до пробела; line сдвигается за него.
+std::string_view next_field(std::string_view& line) {
+    const std::size_t begin = line.find_first_not_of(' ');
+    if (begin == std::string_view::npos) {
+        line = {};
+        return {};
+    }
+    line.remove_prefix(begin);
+    const std::size_t end = std::min(line.find(' '), line.size());
+    const std::string_view field = line.substr(0, end);
+    line.remove_prefix(end);
+    return field;
+}
+
+template <class T>
+bool parse_field(std::string_view& line, T& value) {
+    const std::string_view field = next_field(line);
+    auto [ptr, ec] = std::from_chars(field.data(), field.data() + field.size(), value);
+    return !field.empty() && ec == std::errc() && ptr == field.data() + field.size();
+}
+
+// Разбирает строку трассы. Пустые строки и комментарии — true без операции.
+bool parse_trace_line(std::string_view line, std::vector<TraceOp>& ops) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    const std::size_t begin = line.find_first_not_of(' ');
+    if (begin == std::string_view::npos || line[begin] == '#') {
+        return true;
+    }
+
+    TraceOp op;
+    std::int64_t at = 0;
+    if (!parse_field(line, at) || at < 0) {
+        return false;
+    }
+    op.at = std::chrono::milliseconds(at);
+    const std::string_view kind = next_field(line);
+    if (!parse_field(line, op.id)) {
+        return false;
+    }
+    if (kind == "add") {
+        std::int64_t duration = 0;
+        if (!parse_field(line, duration) || duration < 0) {
+            return false;
+        }
+        op.duration = std::chrono::milliseconds(duration);
+    }
+    else if (kind == "cancel") {
+        op.kind = TraceOp::Kind::Cancel;
+    }
+    else {
+        return false;
+    }
+    if (!next_field(line).empty()) {
+        return false;
+    }
+    ops.push_back(op);
+    return true;
+}
+
+bool trace_load(const std::string& path, std::vector<TraceOp>& ops, std::size_t& bad) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    bad = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!parse_trace_line(line, ops)) ++bad;
+    }
+    return true;
+}
+
+template <class Engine>
+ReplayResult replay(const std::vector<TraceOp>& ops) {
+    using Service = TimerService<Engine, ManualClock, NoLock>;
+    Service service;
+    ManualClock& clock = service.clock();
+    ReplayResult result;
+    ManualClock::time_point last_fire{};
+    // Id при записи -> id в сервисе.
+    std::unordered_map<TimerId, TimerId> ids;
+    ids.reserve(ops.size());
+
+    auto on_fire = [&result, &clock, &last_fire](TimerId, TimerOutcome outcome) {
+        if (outcome == TimerOutcome::Fired) {
+            ++result.fired;
+            last_fire = clock.now();
+        }
+    };
+    // Перескакивает к каждому сроку не позже until, затем к самому until.
+    auto run_until = [&](ManualClock::time_point until) {
+        while (true) {
+            const ManualClock::time_point next = service.next_deadline();
+            if (next > until || next == ManualClock::time_point::max()) {
+                break;
+            }
+            clock.set(std::max(next, clock.now()));
+            service.poll();
+            ++result.jumps;
+        }
+        if (until > clock.now()) {
+            clock.set(until);
+        }
+    };
+
+    const auto start = Clock::now();
+    for (const TraceOp& op : ops) {
+        run_until(ManualClock::time_point(op.at));
+        if (op.kind == TraceOp::Kind::Add) {
+            const TimerId id = service.add(op.duration, on_fire);
+            if (id != kInvalidTimer) {
+                ++result.added;
+                if (op.id != kInvalidTimer) ids[op.id] = id;
+            }
+        }
+        else if (auto it = ids.find(op.id); it != ids.end()) {
+            if (service.cancel(it->second)) ++result.cancelled;
+            ids.erase(it);
+        }
+    }
+    run_until(ManualClock::time_point::max());
+    result.elapsed = Clock::now() - start;
+    result.span = std::chrono::duration_cast<std::chrono::milliseconds>(last_fire.time_since_epoch());
+    return result;
+}
+
+ReplayResult replay_trace(const std::vector<TraceOp>& ops, EngineKind engine) {
+    return engine == EngineKind::Heap ? replay<HeapEngine>(ops) : replay<WheelEngine>(ops);
+}
@@ -0,0 +1,51 @@
+﻿#pragma once
+
+// Трасса команд и её воспроизведение в виртуальном времени.
+//
+// --trace=<файл> в приложении записывает add, run и cancel строками
+//     <мс от начала записи> add <id> <длительность в мс>
+//     <мс от начала записи> cancel <id>
+// (пустые строки и #... при чтении пропускаются); batch, every, pomodoro и chain
+// в трассу не пишутся. replay_trace проигрывает трассу на
+// TimerService с ManualClock: часы не ждут, а сразу перескакивают к следующей команде
+// или к ближайшему сроку, так что трасса за сутки проигрывается за секунды, а время
+// выполнения — чистая цена очереди сроков на операцию, без сна.
+// Проигрывается только отсчёт: метки, колбэки и вывод движка в трассу не попадают.
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "TimerEngine.h"
+
+struct TraceOp {
+    enum class Kind { Add, Cancel };
+
+    std::chrono::milliseconds at{ 0 };       // От начала трассы.
+    Kind kind = Kind::Add;
+    TimerId id = kInvalidTimer;              // Id при записи: по нему cancel находит свой add.
+    std::chrono::milliseconds duration{ 0 }; // Только у Add.
+};
+
+// Запись трассы. Потокобезопасна: команды идут и из цикла ввода, и из потоков сервера.
+bool trace_open(const std::string& path);
+// Неудавшийся add (kInvalidTimer) не записывается.
+void trace_add(TimerId id, std::chrono::milliseconds duration);
+void trace_cancel(TimerId id);
+void trace_close();
+
+// Читает трассу в ops. false — файл не открылся; bad — число строк с ошибками (пропущены).
+bool trace_load(const std::string& path, std::vector<TraceOp>& ops, std::size_t& bad);
+
+struct ReplayResult {
+    std::size_t added = 0;
+    std::size_t cancelled = 0;               // Отменены до срока.
+    std::size_t fired = 0;
+    std::size_t jumps = 0;                   // Перескоков часов (poll).
+    std::chrono::milliseconds span{ 0 };     // Виртуального времени от начала до последнего срабатывания.
+    Clock::duration elapsed{ 0 };            // Настоящего времени на проигрывание.
+};
+
+// Проигрывает ops (по неубыванию at) на очереди движка engine: Heap — куча, иначе колесо.
+ReplayResult replay_trace(const std::vector<TraceOp>& ops, EngineKind engine);
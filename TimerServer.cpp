@@ -0,0 +1,543 @@
+﻿#include "TimerServer.h"
+#include "TimerEngine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#pragma execution_character_set("utf-8")
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+using Socket = int;
+constexpr Socket kNoSocket = -1;
+void close_socket(Socket s) { ::close(s); }
+
+constexpr std::size_t kReadChunk = 64 * 1024;
+constexpr std::size_t kDefaultIoThreads = 2;
+// Больше стольких байт непрочитанных строк (или неотправленного вывода — клиент не читает)
+// соединение не держит и закрывается.
+constexpr std::size_t kMaxInput = std::size_t{ 64 } << 20;
+constexpr std::size_t kMaxOutput = std::size_t{ 64 } << 20;
+
+struct IoThread;
+
+struct Connection {
+    Socket socket = kNoSocket;
+
+    // Ввод — только поток, который сейчас обрабатывает соединение.
+    std::string in;
+    std::size_t waiting = 0;  // batch в начале in ждёт стольких строк; 0 — не ждёт.
+    std::size_t ready = 0;    // Полных строк после неё уже пришло...
+    std::size_t scanned = 0;  // ...до этого места in.
+
+    // Вывод — из любого потока (ответы и события подписки).
+    std::mutex out_mutex;
+    std::string out;          // Ещё не отправлено.
+    bool closing = false;     // exit или конец ввода: закрыть, когда out уйдёт.
+    bool closed = false;
+
+    IoThread* owner = nullptr;
+    std::size_t out_sent = 0; // Под out_mutex: отправленная часть out.
+    bool want_write = false;  // Только владелец: ждём EPOLLOUT.
+};
+
+CommandHandler g_handler;
+Socket g_listen = kNoSocket;
+std::thread g_acceptor;
+std::atomic<bool> g_server_running{ false };
+
+std::mutex g_subscribers_mutex;
+std::vector<std::shared_ptr<Connection>> g_subscribers;
+
+void unsubscribe(const Connection& c) {
+    std::lock_guard<std::mutex> lock(g_subscribers_mutex);
+    g_subscribers.erase(std::remove_if(g_subscribers.begin(), g_subscribers.end(),
+        [&c](const std::shared_ptr<Connection>& s) { return s.get() == &c; }), g_subscribers.end());
+}
+
+// Очередная строка из начала text (без '\n' и '\r'); false — полной строки нет.
+bool take_line(std::string_view& text, std::string_view& line) {
+    const std::size_t eol = text.find('\n');
+    if (eol == std::string_view::npos) {
+        return false;
+    }
+    line = text.substr(0, eol);
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    text.remove_prefix(eol + 1);
+    return true;
+}
+
+// Выполняет все полные строки c.in, ответы каждой строки сразу уходят в c.out
+// (раньше событий, которые она вызовет). false — соединение закрывается.
+bool consume_input(const std::shared_ptr<Connection>& conn) {
+    Connection& c = *conn;
+    std::string_view rest = c.in;
+    std::string reply;
+    bool keep = true;
+    while (keep) {
+        if (c.waiting > 0) {
+            // batch N: выполнять, только когда пришли все N строк; считаем их один раз.
+            for (std::size_t at = c.scanned; c.ready < c.waiting; ++c.ready) {
+                at = c.in.find('\n', at);
+                if (at == std::string::npos) break;
+                c.scanned = ++at;
+            }
+            if (c.ready < c.waiting) {
+                break;
+            }
+        }
+        std::string_view after = rest;
+        std::string_view line;
+        if (!take_line(after, line)) {
+            break;
+        }
+        if (c.waiting == 0) {
+            if (const std::size_t extra = g_handler.extra_lines(line); extra > 0) {
+                c.waiting = extra;
+                c.ready = 0;
+                c.scanned = c.in.size() - after.size();
+                continue;
+            }
+        }
+        c.waiting = 0;
+
+        if (line == "subscribe" || line == "unsubscribe") {
+            unsubscribe(c);
+            if (line == "subscribe") {
+                std::lock_guard<std::mutex> lock(g_subscribers_mutex);
+                g_subscribers.push_back(conn);
+            }
+            reply = "OK\t";
+            reply += line;
+            reply += '\n';
+        }
+        else {
+            set_reply_sink(&reply);
+            keep = g_handler.execute(line, [&after](std::string_view& next) { return take_line(after, next); });
+            set_reply_sink(nullptr);
+        }
+        rest = after;
+        if (!reply.empty()) {
+            std::lock_guard<std::mutex> lock(c.out_mutex);
+            c.out += reply;
+            reply.clear();
+        }
+    }
+    const std::size_t consumed = c.in.size() - rest.size();
+    c.in.erase(0, consumed);
+    if (c.waiting > 0) {
+        c.scanned -= consumed;
+    }
+    return keep && c.in.size() <= kMaxInput;
+}
+
+using AddrLen = socklen_t;
+
+// "<порт>" или "<адрес>:<порт>" ("[::1]:<порт>" — IPv6).
+bool split_address(const std::string& address, std::string& host, std::string& port) {
+    const std::size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        host = "127.0.0.1";
+        port = address;
+    }
+    else {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+    }
+    return !host.empty() && !port.empty() && port.find_first_not_of("0123456789") == std::string::npos;
+}
+
+bool is_loopback(const sockaddr* addr) {
+    if (addr->sa_family == AF_INET) {
+        const auto* v4 = reinterpret_cast<const sockaddr_in*>(addr);
+        return (ntohl(v4->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const auto* v6 = reinterpret_cast<const sockaddr_in6*>(addr);
+        return IN6_IS_ADDR_LOOPBACK(&v6->sin6_addr);
+    }
+    return false;
+}
+
+// Слушающий сокет на первом подошедшем адресе host. Без allow_remote адреса не из
+// loopback пропускаются; refused — пропущен хотя бы один.
+Socket open_listener(const std::string& host, const std::string& port, bool allow_remote, bool& refused) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+        return kNoSocket;
+    }
+    Socket s = kNoSocket;
+    refused = false;
+    for (addrinfo* ai = found; ai && s == kNoSocket; ai = ai->ai_next) {
+        if (!allow_remote && !is_loopback(ai->ai_addr)) {
+            refused = true;
+            continue;
+        }
+        s = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (s == kNoSocket) {
+            continue;
+        }
+        // Перезапуск сразу после выхода не должен ждать TIME_WAIT старых соединений.
+        const int on = 1;
+        ::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (::bind(s, ai->ai_addr, static_cast<AddrLen>(ai->ai_addrlen)) != 0 || ::listen(s, SOMAXCONN) != 0) {
+            close_socket(s);
+            s = kNoSocket;
+        }
+    }
+    freeaddrinfo(found);
+    return s;
+}
+
+// Ответы короткие и идут конвейером: ждать склейки по Нейглу незачем.
+void set_nodelay(Socket s) {
+    const int on = 1;
+    ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+}
+
+// Поток ввода-вывода со своим epoll; соединение обрабатывает только его поток-владелец.
+struct IoThread {
+    int epoll = -1;
+    int wake = -1;       // eventfd: новые соединения и вывод из других потоков.
+    std::thread thread;
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Connection>> incoming; // Под mutex.
+    std::vector<std::shared_ptr<Connection>> to_flush; // Под mutex.
+    std::unordered_map<Connection*, std::shared_ptr<Connection>> connections; // Только свой поток.
+};
+
+std::vector<std::unique_ptr<IoThread>> g_io_threads;
+
+void wake_io(IoThread& io) {
+    const std::uint64_t one = 1;
+    const ssize_t ignored = ::write(io.wake, &one, sizeof(one));
+    (void)ignored;
+}
+
+// Из любого потока: отправить вывод соединения в потоке-владельце.
+void request_flush(const std::shared_ptr<Connection>& conn) {
+    IoThread& io = *conn->owner;
+    bool first;
+    {
+        std::lock_guard<std::mutex> lock(io.mutex);
+        first = io.to_flush.empty();
+        io.to_flush.push_back(conn);
+    }
+    if (first) {
+        wake_io(io);
+    }
+}
+
+void close_connection(IoThread& io, Connection* c) {
+    ::epoll_ctl(io.epoll, EPOLL_CTL_DEL, c->socket, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(c->out_mutex);
+        c->closed = true;
+        c->out.clear();
+    }
+    close_socket(c->socket);
+    unsubscribe(*c);
+    io.connections.erase(c);
+}
+
+// Отправляет, сколько примет сокет; остаток — по EPOLLOUT. false — закрыть соединение.
+bool flush(IoThread& io, Connection& c) {
+    bool drained;
+    {
+        std::lock_guard<std::mutex> lock(c.out_mutex);
+        while (c.out_sent < c.out.size()) {
+            const ssize_t n = ::send(c.socket, c.out.data() + c.out_sent, c.out.size() - c.out_sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                c.out_sent += static_cast<std::size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false;
+        }
+        drained = c.out_sent == c.out.size();
+        if (drained) {
+            c.out.clear();
+            c.out_sent = 0;
+            if (c.closing) return false;
+        }
+        else if (c.out.size() - c.out_sent > kMaxOutput) {
+            return false;
+        }
+        else if (c.out_sent > c.out.size() / 2) {
+            c.out.erase(0, c.out_sent);
+            c.out_sent = 0;
+        }
+    }
+    if (c.want_write == drained) {
+        c.want_write = !drained;
+        epoll_event ev{};
+        ev.events = EPOLLIN | (c.want_write ? EPOLLOUT : 0u);
+        ev.data.ptr = &c;
+        ::epoll_ctl(io.epoll, EPOLL_CTL_MOD, c.socket, &ev);
+    }
+    return true;
+}
+
+// Читает всё пришедшее и выполняет команды. false — закрыть соединение сразу.
+bool handle_readable(IoThread& io, const std::shared_ptr<Connection>& conn, char* buffer) {
+    Connection& c = *conn;
+    bool eof = false;
+    while (c.in.size() <= kMaxInput) {
+        const ssize_t n = ::recv(c.socket, buffer, kReadChunk, 0);
+        if (n > 0) {
+            c.in.append(buffer, static_cast<std::size_t>(n));
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) return false;
+        eof = true;
+        break;
+    }
+    bool closing;
+    {
+        std::lock_guard<std::mutex> lock(c.out_mutex);
+        closing = c.closing;
+    }
+    if (closing) {
+        c.in.clear(); // После exit команды не выполняются.
+    }
+    else if (!consume_input(conn) || eof) {
+        // exit или конец ввода: ответы дописываются, затем соединение закрывается.
+        std::lock_guard<std::mutex> lock(c.out_mutex);
+        c.closing = true;
+    }
+    return flush(io, c);
+}
+
+void io_thread_func(IoThread& io) {
+    std::vector<char> buffer(kReadChunk);
+    epoll_event events[64];
+    std::vector<std::shared_ptr<Connection>> incoming;
+    std::vector<std::shared_ptr<Connection>> to_flush;
+    while (g_server_running.load(std::memory_order_acquire)) {
+        const int n = ::epoll_wait(io.epoll, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == nullptr) {
+                std::uint64_t count;
+                const ssize_t ignored = ::read(io.wake, &count, sizeof(count));
+                (void)ignored;
+                {
+                    std::lock_guard<std::mutex> lock(io.mutex);
+                    incoming.swap(io.incoming);
+                    to_flush.swap(io.to_flush);
+                }
+                for (auto& conn : incoming) {
+                    epoll_event ev{};
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = conn.get();
+                    if (::epoll_ctl(io.epoll, EPOLL_CTL_ADD, conn->socket, &ev) == 0) {
+                        io.connections.emplace(conn.get(), conn);
+                    }
+                    else {
+                        close_socket(conn->socket);
+                    }
+                }
+                for (auto& conn : to_flush) {
+                    if (io.connections.count(conn.get()) && !flush(io, *conn)) {
+                        close_connection(io, conn.get());
+                    }
+                }
+                incoming.clear();
+                to_flush.clear();
+                continue;
+            }
+            // Соединение могло закрыться раньше в этой же пачке событий.
+            auto it = io.connections.find(static_cast<Connection*>(events[i].data.ptr));
+            if (it == io.connections.end()) {
+                continue;
+            }
+            const std::shared_ptr<Connection> conn = it->second;
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ok = handle_readable(io, conn, buffer.data());
+            }
+            if (ok && (events[i].events & EPOLLOUT)) {
+                ok = flush(io, *conn);
+            }
+            if (!ok) {
+                close_connection(io, conn.get());
+            }
+        }
+    }
+}
+
+void acceptor_func() {
+    std::size_t next = 0;
+    while (g_server_running.load()) {
+        const Socket s = ::accept4(g_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s == kNoSocket) {
+            if (!g_server_running.load()) return;
+            if (errno != EINTR && errno != ECONNABORTED) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10)); // EMFILE и т. п.
+            }
+            continue;
+        }
+        set_nodelay(s);
+        auto conn = std::make_shared<Connection>();
+        conn->socket = s;
+        IoThread& io = *g_io_threads[next++ % g_io_threads.size()];
+        conn->owner = &io;
+        {
+            std::lock_guard<std::mutex> lock(io.mutex);
+            io.incoming.push_back(std::move(conn));
+        }
+        wake_io(io);
+    }
+}
+
+bool start_io(std::size_t threads) {
+    for (std::size_t i = 0; i < threads; ++i) {
+        auto io = std::make_unique<IoThread>();
+        io->epoll = ::epoll_create1(EPOLL_CLOEXEC);
+        io->wake = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        if (io->epoll < 0 || io->wake < 0 || ::epoll_ctl(io->epoll, EPOLL_CTL_ADD, io->wake, &ev) != 0) {
+            if (io->epoll >= 0) ::close(io->epoll);
+            if (io->wake >= 0) ::close(io->wake);
+            return false;
+        }
+        g_io_threads.push_back(std::move(io));
+    }
+    for (auto& io : g_io_threads) {
+        io->thread = std::thread(io_thread_func, std::ref(*io));
+    }
+    return true;
+}
+
+void stop_io() {
+    for (auto& io : g_io_threads) {
+        wake_io(*io);
+    }
+    for (auto& io : g_io_threads) {
+        if (io->thread.joinable()) io->thread.join();
+        while (!io->connections.empty()) {
+            close_connection(*io, io->connections.begin()->first);
+        }
+        for (auto& conn : io->incoming) {
+            close_socket(conn->socket);
+        }
+        ::close(io->epoll);
+        ::close(io->wake);
+    }
+    g_io_threads.clear();
+}
+
+// accept возвращает ошибку, как только слушающий сокет закрыт на приём.
+void stop_listening() {
+    ::shutdown(g_listen, SHUT_RDWR);
+    ::close(g_listen);
+}
+
+void server_broadcast(std::string_view events) {
+    std::lock_guard<std::mutex> lock(g_subscribers_mutex);
+    for (const auto& conn : g_subscribers) {
+        {
+            std::lock_guard<std::mutex> out_lock(conn->out_mutex);
+            if (conn->closed) continue;
+            conn->out += events;
+        }
+        request_flush(conn);
+    }
+}
+
+bool server_start(const std::string& address, std::size_t io_threads, CommandHandler handler, bool allow_remote) {
+    std::string host;
+    std::string port;
+    if (!split_address(address, host, port)) {
+        print_error("bad_address", "Неверный адрес: " + address + "\n", address);
+        return false;
+    }
+    g_handler = std::move(handler);
+    g_server_running.store(true);
+    if (!start_io(io_threads > 0 ? io_threads : kDefaultIoThreads)) {
+        g_server_running.store(false);
+        print_error("listen_failed", "Не удалось запустить потоки ввода-вывода.\n", address);
+        return false;
+    }
+    bool refused = false;
+    g_listen = open_listener(host, port, allow_remote, refused);
+    if (g_listen == kNoSocket) {
+        g_server_running.store(false);
+        stop_io();
+        if (refused) {
+            print_error("not_loopback",
+                "Адрес " + address + " доступен из сети, а аутентификации нет; нужен --allow-remote\n", address);
+        }
+        else {
+            print_error("listen_failed", "Не удалось слушать " + address + "\n", address);
+        }
+        return false;
+    }
+    g_acceptor = std::thread(acceptor_func);
+    return true;
+}
+
+void server_stop() {
+    if (!g_acceptor.joinable()) {
+        return;
+    }
+    g_server_running.store(false);
+    stop_listening();
+    g_acceptor.join();
+    g_listen = kNoSocket;
+    // После этого события никуда не рассылаются, и потоки можно останавливать.
+    {
+        std::lock_guard<std::mutex> lock(g_subscribers_mutex);
+        g_subscribers.clear();
+    }
+    stop_io();
+}
+
+#else
+
+// На Windows сервер не собирался и не проверялся, поэтому --listen там отклоняется.
+void server_broadcast(std::string_view) {}
+
+bool server_start(const std::string& address, std::size_t, CommandHandler, bool) {
+    print_error("listen_unsupported", "--listen на Windows не поддерживается.\n", address);
+    return false;
+}
+
+void server_stop() {}
+
+#endif
@@ -0,0 +1,39 @@
+﻿#pragma once
+
+// Сетевой интерфейс (--listen): TCP-сервер с той же грамматикой команд, что у stdin,
+// и ответами в формате --pipe. Клиент может слать сколько угодно строк подряд, не дожидаясь
+// ответов (конвейер): сервер выполняет все пришедшие строки по порядку и отправляет ответы
+// одной записью. Команда subscribe подписывает соединение на события, которые не являются
+// ответами (DONE, NEXT, EXIT, периодическая статистика), unsubscribe — отписывает,
+// exit — закрывает соединение.
+// Ввод-вывод — несколько потоков со своим epoll у каждого, соединения раздаются потокам
+// по кругу. Команды выполняются в потоке ввода-вывода своего соединения.
+// Только POSIX: на Windows server_start сообщает listen_unsupported и возвращает false.
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+
+// Команды сервера задаёт приложение.
+struct CommandHandler {
+    // Сколько следующих строк забирает команда (batch N). Сервер выполняет её,
+    // только когда все они уже пришли.
+    std::function<std::size_t(std::string_view line)> extra_lines;
+    // Выполняет команду, ответы — через safe_print/print_error/log_event (см. set_reply_sink).
+    // next_line отдаёт следующие строки того же соединения. false — закрыть соединение.
+    std::function<bool(std::string_view line, const std::function<bool(std::string_view&)>& next_line)> execute;
+};
+
+// Рассылает события подписчикам; это g_event_hook сервера (задаётся до start_engine()).
+void server_broadcast(std::string_view events);
+
+// Начинает слушать address — "<порт>" (только 127.0.0.1) или "<адрес>:<порт>" — и запускает
+// io_threads потоков (0 — два). Аутентификации нет, поэтому адрес должен быть loopback
+// (127.0.0.0/8, ::1), если не задано allow_remote (0.0.0.0:<порт> — все интерфейсы).
+// Вызывается после start_engine(). false — адрес не разобран, занят или не loopback
+// без allow_remote (ошибка уже выведена).
+bool server_start(const std::string& address, std::size_t io_threads, CommandHandler handler,
+    bool allow_remote = false);
+// Закрывает все соединения и останавливает потоки; после возврата команд не выполняется.
+void server_stop();
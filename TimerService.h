@@ -0,0 +1,232 @@
+﻿#pragma once
+
+// Дополнительный встраиваемый сервис таймеров без потоков, собранный из политик
+// на этапе компиляции:
+//
+//     TimerService<Engine, ClockPolicy, LockPolicy>
+//
+// Engine — очередь сроков (WheelEngine, HeapEngine), ClockPolicy — откуда брать время
+// (SteadyClock, ManualClock), LockPolicy — защита состояния (NoLock, MutexLock).
+// Сервис не заводит потоков: владелец сам вызывает poll(), когда наступает next_deadline(),
+// и колбэки выполняются в его потоке. С NoLock сервис однопоточный и не содержит ни
+// атомиков, ни блокировок — для встраиваемого цикла событий, где всё в одном потоке:
+//
+//     TimerService<HeapEngine> timers;
+//     timers.add(std::chrono::seconds(5), [](TimerId, TimerOutcome) { blink(); });
+//     while (...) { wait_until(timers.next_deadline()); timers.poll(); }
+//
+// С ManualClock время двигает сам владелец (clock().advance), что и нужно тестам:
+// срабатывания детерминированы и не требуют ожидания.
+// С MutexLock add и cancel можно вызывать из любых потоков, а poll — из одного.
+// Движок приложения сервис не заменяет и политик не принимает: add_timer, --engine и
+// --shards выбираются при запуске, время он берёт из steady_clock, а main сервис не
+// создаёт. Общие с движком — только очереди сроков (TimerQueues.h). Сервис собирают
+// лишь replay_trace (TimerReplay.cpp: bench --replay и случай replay) и случай service
+// бенчмарка, который сверяет его срабатывания: не раньше срока и не позже тика колеса.
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "TimerEngine.h"
+#include "TimerQueues.h"
+
+// Очереди сроков.
+struct WheelEngine {
+    template <class TimePoint>
+    using Queue = BasicTimingWheel<TimePoint>; // Срок округляется вверх до тика 10 мс.
+};
+
+struct HeapEngine {
+    template <class TimePoint>
+    using Queue = BasicTimerHeap<TimePoint>;   // Точный срок, O(log n) на таймер.
+};
+
+// Часы. Политика даёт типы времени и now().
+struct SteadyClock {
+    using time_point = Clock::time_point;
+    using duration = Clock::duration;
+
+    time_point now() const { return Clock::now(); }
+};
+
+// Часы, которые идут только по advance/set. Свой тип time_point не даёт смешать
+// их моменты с моментами steady_clock.
+class ManualClock {
+public:
+    using duration = std::chrono::nanoseconds;
+    using time_point = std::chrono::time_point<ManualClock, duration>;
+
+    time_point now() const { return now_; }
+    void advance(duration d) { now_ += d; }
+    void set(time_point tp) { now_ = tp; }
+
+private:
+    time_point now_{};
+};
+
+// Блокировки. Политика — BasicLockable.
+struct NoLock {
+    void lock() {}
+    void unlock() {}
+};
+
+class MutexLock {
+public:
+    void lock() { mutex_.lock(); }
+    void unlock() { mutex_.unlock(); }
+
+private:
+    std::mutex mutex_;
+};
+
+template <class Engine, class ClockPolicy = SteadyClock, class LockPolicy = NoLock>
+class TimerService {
+public:
+    using time_point = typename ClockPolicy::time_point;
+    using duration = typename ClockPolicy::duration;
+    // Как у add_timer. Колбэк не должен бросать исключения.
+    using Callback = std::function<void(TimerId id, TimerOutcome outcome)>;
+
+    explicit TimerService(ClockPolicy clock = {})
+        : clock_(std::move(clock)), queue_(clock_.now()) {}
+
+    TimerService(const TimerService&) = delete;
+    TimerService& operator=(const TimerService&) = delete;
+
+    ClockPolicy& clock() { return clock_; }
+
+    // Таймер со сроком через after от clock().now(). kInvalidTimer — таблица заполнена.
+    TimerId add(duration after, Callback on_fire) {
+        std::lock_guard guard(lock_);
+        return insert(clock_.now() + after, std::move(on_fire));
+    }
+
+    TimerId add_at(time_point end, Callback on_fire) {
+        std::lock_guard guard(lock_);
+        return insert(end, std::move(on_fire));
+    }
+
+    // true — таймер ждал и отменён сейчас; его колбэк вызывается здесь же с Cancelled.
+    bool cancel(TimerId id) {
+        Callback callback;
+        {
+            std::lock_guard guard(lock_);
+            Slot* slot = find(id);
+            if (!slot) {
+                return false;
+            }
+            callback = release(*slot, id);
+        }
+        if (callback) {
+            callback(id, TimerOutcome::Cancelled);
+        }
+        return true;
+    }
+
+    // Срабатывает всё, чей срок наступил к clock().now(), колбэки — в вызвавшем потоке
+    // и вне блокировки, так что из них можно добавлять и отменять таймеры и даже снова
+    // вызвать poll. Возвращает число сработавших.
+    std::size_t poll() {
+        // Буфер забираем себе: вложенный poll из колбэка возьмёт другой и не испортит наш обход.
+        std::vector<std::pair<TimerId, Callback>> due;
+        due.swap(due_);
+        {
+            std::lock_guard guard(lock_);
+            queue_.advance(clock_.now(), fired_);
+            for (TimerId id : fired_) {
+                // Отменённые таймеры остаются в очереди до своего срока и здесь просто отбрасываются.
+                if (Slot* slot = find(id)) {
+                    due.emplace_back(id, release(*slot, id));
+                }
+            }
+            fired_.clear();
+        }
+        const std::size_t count = due.size();
+        for (auto& [id, callback] : due) {
+            if (callback) {
+                callback(id, TimerOutcome::Fired);
+            }
+        }
+        due.clear();
+        if (due.capacity() > due_.capacity()) {
+            due_.swap(due);
+        }
+        return count;
+    }
+
+    // Когда снова вызывать poll; time_point::max() — ждать нечего. У колеса — с точностью
+    // до тика и с пробуждениями ради каскадов, у кучи — ровно ближайший срок.
+    time_point next_deadline() {
+        std::lock_guard guard(lock_);
+        return queue_.next_deadline();
+    }
+
+    // Ожидающие таймеры.
+    std::size_t size() {
+        std::lock_guard guard(lock_);
+        return active_;
+    }
+
+private:
+    // Слот таблицы; id — номер слота + 1 и поколение, как у движка (шард 0).
+    struct Slot {
+        Callback callback;
+        std::uint32_t generation = 0;
+        bool armed = false;
+    };
+
+    TimerId insert(time_point end, Callback on_fire) {
+        std::size_t index;
+        if (!free_.empty()) {
+            index = free_.back();
+            free_.pop_back();
+        }
+        else {
+            if (slots_.size() >= kTimerSlotMask) {
+                return kInvalidTimer;
+            }
+            index = slots_.size();
+            slots_.emplace_back();
+        }
+        Slot& slot = slots_[index];
+        slot.callback = std::move(on_fire);
+        slot.armed = true;
+        ++active_;
+        const TimerId id = (TimerId{ slot.generation } << 32) | (index + 1);
+        queue_.insert(id, end);
+        return id;
+    }
+
+    Slot* find(TimerId id) {
+        const TimerId index = (id & kTimerSlotMask) - 1;
+        if (id == kInvalidTimer || shard_of(id) != 0 || index >= slots_.size()) {
+            return nullptr;
+        }
+        Slot& slot = slots_[index];
+        return slot.armed && slot.generation == static_cast<std::uint32_t>(id >> 32) ? &slot : nullptr;
+    }
+
+    // Освобождает слот для следующего таймера; новое поколение отличает его id от старого.
+    Callback release(Slot& slot, TimerId id) {
+        Callback callback = std::move(slot.callback);
+        slot.callback = nullptr;
+        slot.armed = false;
+        ++slot.generation;
+        --active_;
+        free_.push_back(static_cast<std::size_t>((id & kTimerSlotMask) - 1));
+        return callback;
+    }
+
+    [[no_unique_address]] ClockPolicy clock_;
+    [[no_unique_address]] LockPolicy lock_;
+    typename Engine::template Queue<time_point> queue_;
+    std::vector<Slot> slots_;
+    std::vector<std::size_t> free_;                       // Свободные слоты.
+    std::size_t active_ = 0;
+    std::vector<TimerId> fired_;                          // Под lock_; ёмкость переиспользуется.
+    std::vector<std::pair<TimerId, Callback>> due_;       // Только в poll; ёмкость переиспользуется.
+};
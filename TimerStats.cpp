@@ -0,0 +1,109 @@
+﻿#include "TimerStats.h"
+
+#include <atomic>
+#include <bit>
+#include <cmath>
+
+#ifdef _WIN32
+#pragma execution_character_set("utf-8")
+#endif
+
+// Одна полоса статистики. Поток получает полосу при первой записи и дальше пишет
+// только в неё: на полосу приходится несколько потоков лишь при их числе больше kShards,
+// поэтому relaxed-инкременты почти всегда попадают в «свою» кэш-линию.
+struct alignas(64) StatsShard {
+    struct MetricCells {
+        std::atomic<std::uint64_t> count{ 0 };
+        std::atomic<std::uint64_t> sum{ 0 };
+        std::atomic<std::uint64_t> max{ 0 };
+        std::atomic<std::uint64_t> buckets[Histogram::kBuckets] = {};
+    };
+
+    std::atomic<std::uint64_t> counters[kCounterCount] = {};
+    MetricCells metrics[kMetricCount];
+};
+
+constexpr std::size_t kShards = 16;
+
+StatsShard g_stats_shards[kShards];
+std::atomic<std::size_t> g_stats_next_shard{ 0 };
+
+StatsShard& current_shard() {
+    thread_local StatsShard& shard =
+        g_stats_shards[g_stats_next_shard.fetch_add(1, std::memory_order_relaxed) % kShards];
+    return shard;
+}
+
+std::size_t Histogram::bucket_of(std::uint64_t value) {
+    if (value < kSub) {
+        return static_cast<std::size_t>(value);
+    }
+    const int exp = std::bit_width(value) - 1; // >= kSubBits
+    const std::size_t mantissa = static_cast<std::size_t>(value >> (exp - kSubBits)) & (kSub - 1);
+    return static_cast<std::size_t>(exp - kSubBits + 1) * kSub + mantissa;
+}
+
+std::uint64_t Histogram::bucket_upper(std::size_t bucket) {
+    if (bucket < kSub) {
+        return bucket;
+    }
+    const int shift = static_cast<int>(bucket / kSub) - 1;
+    const std::uint64_t lower = static_cast<std::uint64_t>(kSub + bucket % kSub) << shift;
+    // Для последней корзины сумма переполняется ровно до UINT64_MAX.
+    return lower + ((std::uint64_t{ 1 } << shift) - 1);
+}
+
+std::uint64_t HistogramSnapshot::percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+    auto rank = static_cast<std::uint64_t>(std::ceil(p * static_cast<double>(count)));
+    if (rank == 0) rank = 1;
+    std::uint64_t seen = 0;
+    for (std::size_t b = 0; b < buckets.size(); ++b) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            const std::uint64_t upper = Histogram::bucket_upper(b);
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+void stats_record(Metric metric, Clock::duration value) {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(value).count();
+    const std::uint64_t v = ns > 0 ? static_cast<std::uint64_t>(ns) : 0;
+
+    StatsShard::MetricCells& m = current_shard().metrics[static_cast<std::size_t>(metric)];
+    m.count.fetch_add(1, std::memory_order_relaxed);
+    m.sum.fetch_add(v, std::memory_order_relaxed);
+    m.buckets[Histogram::bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+    std::uint64_t seen = m.max.load(std::memory_order_relaxed);
+    while (v > seen && !m.max.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {
+    }
+}
+
+void stats_count(Counter counter, std::uint64_t n) {
+    current_shard().counters[static_cast<std::size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+}
+
+StatsSnapshot stats_snapshot() {
+    StatsSnapshot snap;
+    for (const StatsShard& shard : g_stats_shards) {
+        for (std::size_t c = 0; c < kCounterCount; ++c) {
+            snap.counters[c] += shard.counters[c].load(std::memory_order_relaxed);
+        }
+        for (std::size_t i = 0; i < kMetricCount; ++i) {
+            const StatsShard::MetricCells& m = shard.metrics[i];
+            HistogramSnapshot& out = snap.metrics[i];
+            out.count += m.count.load(std::memory_order_relaxed);
+            out.sum += m.sum.load(std::memory_order_relaxed);
+            const std::uint64_t max = m.max.load(std::memory_order_relaxed);
+            if (max > out.max) out.max = max;
+            for (std::size_t b = 0; b < Histogram::kBuckets; ++b) {
+                out.buckets[b] += m.buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return snap;
+}
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+// Статистика движка для команды stats: счётчики событий и гистограммы задержек.
+// Запись — из любого потока без блокировок: потоки пишут в свои полосы (StatsShard),
+// снимок складывает полосы. Внутренний заголовок движка (TimerEngine.cpp).
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+#include "TimerEngine.h"
+
+// Измеряемые задержки.
+enum class Metric : std::uint8_t {
+    FireLateness,   // Момент обработки срабатывания минус TimerInfo::end.
+    TimersLockWait, // Ожидание мьютекса шарда (0, если мьютекс был свободен).
+    LogWait,        // Постановка сообщения в очередь вывода (включая ожидание места).
+    AddLatency,     // add_timer целиком.
+    CancelLatency,  // cancel_timer целиком.
+    CallbackWait    // Колбэк on_fire в очереди пула: от срабатывания до начала выполнения.
+};
+constexpr std::size_t kMetricCount = 6;
+
+enum class Counter : std::uint8_t {
+    Added,
+    Fired,      // Все срабатывания, включая фазы цепочек.
+    Rearmed,    // Из них — с перевзводом цепочки на следующую фазу.
+    Cancelled,
+    Wakeups,    // Пробуждения диспетчеров шардов.
+    Batches     // Пачки срабатываний диспетчеров (см. g_slack).
+};
+constexpr std::size_t kCounterCount = 6;
+
+// Log-linear корзины в духе HdrHistogram: значения (в наносекундах) меньше 8 —
+// каждое в своей корзине, дальше по 8 корзин на степень двойки.
+// Относительная ошибка не больше 1/8 на всём диапазоне uint64.
+struct Histogram {
+    static constexpr int kSubBits = 3;
+    static constexpr std::size_t kSub = std::size_t{ 1 } << kSubBits;
+    static constexpr std::size_t kBuckets = (64 - kSubBits + 1) * kSub;
+
+    static std::size_t bucket_of(std::uint64_t value);
+    // Наибольшее значение, попадающее в корзину.
+    static std::uint64_t bucket_upper(std::size_t bucket);
+};
+
+struct HistogramSnapshot {
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+    std::uint64_t max = 0;
+    std::array<std::uint64_t, Histogram::kBuckets> buckets{};
+
+    // Значение, не меньше которого p-я доля (0..1) выборки; оценка сверху по корзине.
+    std::uint64_t percentile(double p) const;
+};
+
+struct StatsSnapshot {
+    std::array<HistogramSnapshot, kMetricCount> metrics;
+    std::array<std::uint64_t, kCounterCount> counters{};
+};
+
+void stats_record(Metric metric, Clock::duration value);
+void stats_count(Counter counter, std::uint64_t n = 1);
+// Сумма всех полос. Не атомарна относительно идущих записей, для отчёта этого достаточно.
+StatsSnapshot stats_snapshot();